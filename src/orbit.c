@@ -1,10 +1,19 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <SDL2/SDL.h>
 
 #define GRID_W 640
@@ -14,6 +23,115 @@
 #define CURRENT_MASS_STEP   2.f
 #define CURRENT_BOUNCE_STEP 0.5f
 
+/* Expansion order of the FMM solver. Changed with 5/6 or `--fmm-order'. */
+#define FMM_DEFAULT_ORDER 4
+#define FMM_MAX_ORDER     12
+
+/* Maximum number of bodies we would like in a leaf of the FMM quadtree, and
+ * the maximum depth of the tree. */
+#define FMM_LEAF_SIZE 16
+#define FMM_MAX_LEVEL 10
+
+/* Minimum distance, in cell sides, between a body outside of the FMM quadtree
+ * and the center of a cell for using the expansions of the cell. */
+#define FMM_OUTLIER_SEPARATION 2.0
+
+/* Number of mesh nodes along the X axis of the particle-mesh solver. Changed
+ * with 7/8 or `--pm-resolution'. */
+#define PM_DEFAULT_RESOLUTION 128
+#define PM_MIN_RESOLUTION     16
+#define PM_MAX_RESOLUTION     1024
+
+/* Scale of the Gaussian force split of P3M, in mesh spacings, and radius of
+ * the short-range correction, in multiples of that scale. See `pm_long_range'.
+ */
+#define PM_P3M_SPLIT  1.25f
+#define PM_P3M_CUTOFF 4.5f
+
+/* Number of targets checked against direct summation in `--bench', and
+ * number of bodies added outside of the window for the second scene, at
+ * BENCH_OUTLIER_DISTANCE or just outside of the region near the window. The
+ * second scene also has a body of BENCH_HEAVY_MASS, which pulls the whole
+ * window. */
+#define BENCH_SAMPLE           1000
+#define BENCH_OUTLIERS         16
+#define BENCH_OUTLIER_DISTANCE 100000.f
+#define BENCH_HEAVY_MASS       50.f
+
+/* P3M resolutions are skipped in `--bench' when each body would have more than
+ * this number of bodies within the cutoff, since they are as slow as the
+ * direct sum. */
+#define BENCH_P3M_NEIGHBOURS 1000
+
+/* Distance from the window at which bodies are retired with BOUNDS_RETIRE */
+#define RETIRE_MARGIN 4096.f
+
+/* Distance from the window at which bodies are grouped in the far field, and
+ * the size of the cells used for grouping them. See `apply_accelerations'. */
+#define FAR_FIELD_MARGIN 640.f
+#define FAR_FIELD_CELL   512.f
+
+/* Cells of the far field are only grouped when their size is below this
+ * fraction of their distance, and the levels of their tree. See
+ * `attract_cells'. */
+#define FAR_FIELD_THETA  0.5f
+#define FAR_FIELD_LEVELS 21
+
+/* Size in pixels of the cells of the static field cache, and number of cells
+ * covering the window. */
+#define STATIC_CACHE_CELL 8
+#define STATIC_CACHE_W    ((GRID_W + STATIC_CACHE_CELL - 1) / STATIC_CACHE_CELL)
+#define STATIC_CACHE_H    ((GRID_H + STATIC_CACHE_CELL - 1) / STATIC_CACHE_CELL)
+
+/* Extra cells around a static body that are still calculated directly */
+#define STATIC_CACHE_MARGIN 2
+
+/* Scenes simulated together by the ensemble runner, and the radius of the ring
+ * of bodies in each scene. See `run_ensemble'. */
+#define ENSEMBLE_LANES       8
+#define ENSEMBLE_RING_RADIUS 120.f
+
+/* Domain decomposition. Bodies within DOMAIN_HALO of other domains are
+ * calculated directly, and the rest in cells of DOMAIN_CELL pixels. Every
+ * DOMAIN_REBALANCE steps, the slabs are moved if a domain has more than
+ * DOMAIN_IMBALANCE times the average number of bodies. See `run_domains'. */
+#define DOMAIN_MAX       64
+#define DOMAIN_HALO      64.f
+#define DOMAIN_CELL      32
+#define DOMAIN_CELLS_W   (GRID_W / DOMAIN_CELL)
+#define DOMAIN_CELLS_H   (GRID_H / DOMAIN_CELL)
+#define DOMAIN_BINS      1024
+#define DOMAIN_REBALANCE 50
+#define DOMAIN_IMBALANCE 1.1
+
+/* Camera limits and steps. The pan step is in screen pixels. */
+#define CAMERA_MIN_ZOOM  (1.f / 64.f)
+#define CAMERA_MAX_ZOOM  64.f
+#define CAMERA_ZOOM_STEP 1.25f
+#define CAMERA_PAN_STEP  32.f
+
+/* Frame pacing. Each frame, the slack left by rendering is used for substeps,
+ * up to FRAME_MAX_SUBSTEPS. If the simulation falls behind by more than
+ * FRAME_MAX_STEPS steps, the rest of the time is dropped. FRAME_BUDGET is the
+ * fraction of each frame that can be used by the physics and rendering, and
+ * FRAME_SMOOTHING is the weight of each new measure in the averages of their
+ * costs. See `frame_substeps'. */
+#define FRAME_SECONDS      (1.0 / FPS)
+#define FRAME_MAX_SUBSTEPS 8
+#define FRAME_MAX_STEPS    4
+#define FRAME_BUDGET       0.75
+#define FRAME_SMOOTHING    0.125
+
+/* Number of colors used for pixels with more than one body */
+#define HEATMAP_LEVELS 8
+
+/* Frames waiting to be written when exporting, see `export_frame' */
+#define EXPORT_QUEUE 8
+
+/* Identifier and version of the input journal files */
+#define JOURNAL_MAGIC   "ORBJ"
+#define JOURNAL_VERSION 5
+
 #define LENGTH(ARR) (sizeof(ARR) / sizeof((ARR)[0]))
 
 /*----------------------------------------------------------------------------*/
@@ -24,6 +142,81 @@ typedef enum EBodyType {
     BODY_DYNAMIC = 1, /* It can move */
 } EBodyType;
 
+typedef enum EGravitySolver {
+    GRAVITY_DIRECT = 0, /* O(N^2) pairwise sum, see `apply_accelerations' */
+    GRAVITY_FMM    = 1, /* O(N) Fast Multipole Method, see `apply_fmm' */
+    GRAVITY_PM     = 2, /* FFT particle-mesh, see `apply_pm' */
+
+    GRAVITY_SOLVER_COUNT,
+} EGravitySolver;
+
+/* What happens to the bodies that leave the window */
+typedef enum EBoundsPolicy {
+    BOUNDS_OPEN    = 0, /* Nothing, they keep moving forever */
+    BOUNDS_WRAP    = 1, /* They appear on the opposite side */
+    BOUNDS_REFLECT = 2, /* They bounce on the edges */
+    BOUNDS_RETIRE  = 3, /* Removed when far enough, see RETIRE_MARGIN */
+
+    BOUNDS_POLICY_COUNT,
+} EBoundsPolicy;
+
+/* Everything the user can do in the simulation. See `apply_action'. */
+typedef enum EActionType {
+    ACTION_QUIT = 0,
+    ACTION_ADD_DYNAMIC,
+    ACTION_ADD_STATIC,
+    ACTION_CLEAR,
+    ACTION_MASS_DOWN,
+    ACTION_MASS_UP,
+    ACTION_BOUNCE_DOWN,
+    ACTION_BOUNCE_UP,
+    ACTION_FMM_ORDER_DOWN,
+    ACTION_FMM_ORDER_UP,
+    ACTION_PM_RESOLUTION_DOWN,
+    ACTION_PM_RESOLUTION_UP,
+    ACTION_TOGGLE_P3M,
+    ACTION_CYCLE_SOLVER,
+    ACTION_CYCLE_BOUNDS,
+    ACTION_TOGGLE_STATIC_CACHE,
+    ACTION_SET_SUBSTEPS,
+} EActionType;
+
+/* Action applied in a simulation step. This is also the record format of the
+ * input journal, so it has a fixed size. */
+typedef struct Action {
+    uint64_t step; /* Simulation step in which the action was applied */
+    uint32_t type; /* EActionType */
+    float x, y;     /* Position, for actions that add bodies */
+    uint32_t value; /* Value, for actions that set a number */
+} Action;
+
+/* Header of the input journal, with the settings at the start of the
+ * recording. The journal uses the native byte order. New versions only add
+ * fields at the end, see `journal_header_size'. */
+typedef struct JournalHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t gravity_solver;
+    int32_t fmm_order;
+    int32_t pm_resolution;
+    uint32_t pm_p3m;
+    float current_mass;
+    float current_bounce;
+    uint32_t bounds_policy;
+    uint32_t static_cache;
+    uint32_t far_field;
+} JournalHeader;
+
+/* Transform from world to screen coordinates. It only affects rendering and
+ * the position of new bodies, not the simulation. */
+typedef struct Camera {
+    /* World position of the top-left corner of the window */
+    float x, y;
+
+    /* Screen pixels per world unit */
+    float zoom;
+} Camera;
+
 typedef struct Body {
     /* Next body in the linked list */
     struct Body* next;
@@ -35,6 +228,10 @@ typedef struct Body {
     /* X and Y positions */
     float x, y;
 
+    /* X and Y positions before the last simulation step, used for
+     * interpolating when rendering. */
+    float prev_x, prev_y;
+
     /* X and Y velocity */
     float vel_x, vel_y;
 
@@ -46,8 +243,42 @@ typedef struct Body {
 /*----------------------------------------------------------------------------*/
 /* Globals */
 
-/* Linked list of Body structures */
-static Body* bodies = NULL;
+/* Linked list of Body structures, and its last element */
+static Body* bodies    = NULL;
+static Body* last_body = NULL;
+
+/* Linked list of retired bodies, reused by `add_body' */
+static Body* free_list = NULL;
+
+/* Whether the gravity of static bodies is precomputed, see
+ * `apply_static_field'. The cache is rebuilt when the static bodies change.
+ * It's faster but approximate, so it's disabled by default. Toggled with S. */
+static bool static_cache       = false;
+static bool static_cache_dirty = true;
+
+/* Biggest dynamic mass supported by the static field cache. Adding a bigger
+ * body rebuilds it, and bigger bodies that enter the window are calculated
+ * directly, see `static_near_distance'. */
+static float static_cache_reach = 0.f;
+
+/* Whether bodies far from the window are grouped in the direct solver, see
+ * `apply_accelerations_far' */
+static bool far_field = true;
+
+/* What happens to the bodies that leave the window. Cycled with B. */
+static EBoundsPolicy bounds_policy = BOUNDS_OPEN;
+
+/* Number of simulation steps since the start */
+static uint64_t sim_step = 0;
+
+/* Number of substeps in each simulation step, and the duration of each one in
+ * steps. Chosen by the frame pacer depending on the free time, see
+ * `frame_substeps'. */
+static int sim_substeps = 1;
+static float sim_dt     = 1.f;
+
+/* Input journal being recorded, if any. See `journal_record'. */
+static FILE* journal = NULL;
 
 /* Current mass for new bodies. Controlled with MWheel or 1/2. */
 static float current_mass = 7.f;
@@ -55,12 +286,43 @@ static float current_mass = 7.f;
 /* Current bounce power when bodies collide. Controlled with 3/4. */
 static float current_bounce = 1.f;
 
+/* Whether collisions are scaled by `current_bounce'. Journals before version 4
+ * were recorded when they always kept the whole velocity. */
+static bool bounce_collisions = true;
+
+/* Method used for calculating the gravity accelerations. Cycled with G. */
+static EGravitySolver gravity_solver = GRAVITY_DIRECT;
+
+/* Expansion order used by the FMM solver */
+static int fmm_order = FMM_DEFAULT_ORDER;
+
+/* Mesh nodes along the X axis of the particle-mesh solver */
+static int pm_resolution = PM_DEFAULT_RESOLUTION;
+
+/* Whether the particle-mesh solver calculates close pairs directly (P3M).
+ * Toggled with P. */
+static bool pm_p3m = true;
+
+/* Current camera, moved with the arrows, middle mouse button, +/- and
+ * Ctrl+MWheel. */
+static Camera camera = { 0.f, 0.f, 1.f };
+
+/* Number of bodies in each scene of the ensemble runner */
+static int ensemble_bodies = 8;
+
 /* Color palette for different types of bodies */
 static uint32_t color_palette[] = {
     [BODY_STATIC]  = 0x555555,
     [BODY_DYNAMIC] = 0xCCCCCC,
 };
 
+/* Colors of the pixels with more than one body, from 2 bodies up to
+ * 2^HEATMAP_LEVELS or more. */
+static uint32_t heatmap_palette[HEATMAP_LEVELS] = {
+    0x1B3A8C, 0x2E5FB8, 0x3F8FD0, 0x5BBFC8,
+    0x8DDB9A, 0xD7E86A, 0xF5B942, 0xFF6A2E,
+};
+
 /*----------------------------------------------------------------------------*/
 /* Misc utils */
 
@@ -166,30 +428,29 @@ static int draw_circle_filled(SDL_Renderer* rend, int x, int y, int r,
 /*----------------------------------------------------------------------------*/
 /* Orbit functions */
 
-static Body* get_last_body(void) {
-    Body* body = bodies;
-
-    /* Caller should make sure this is never the case */
-    if (!body)
-        return NULL;
-
-    while (body->next != NULL)
-        body = body->next;
+static void add_body(float x, float y, EBodyType type) {
+    /* Reuse a retired Body, or allocate a new one. The current mass is changed
+     * by the user, see comment in global variable. */
+    Body* new_body = free_list;
+    if (new_body != NULL)
+        free_list = new_body->next;
+    else
+        new_body = malloc(sizeof(Body));
 
-    return body;
-}
+    new_body->type   = type;
+    new_body->mass   = current_mass;
+    new_body->x      = x;
+    new_body->y      = y;
+    new_body->prev_x = x;
+    new_body->prev_y = y;
+    new_body->vel_x  = 0.f;
+    new_body->vel_y  = 0.f;
+    new_body->next   = NULL;
 
-static void add_body(float x, float y, EBodyType type) {
-    /* Allocate new Body. The current mass is changed by the user, see comment
-     * in global variable. */
-    Body* new_body  = malloc(sizeof(Body));
-    new_body->type  = type;
-    new_body->mass  = current_mass;
-    new_body->x     = x;
-    new_body->y     = y;
-    new_body->vel_x = 0.f;
-    new_body->vel_y = 0.f;
-    new_body->next  = NULL;
+    /* The static field cache depends on the static bodies, and on the size of
+     * the dynamic ones */
+    if (type == BODY_STATIC || current_mass > static_cache_reach)
+        static_cache_dirty = true;
 
     /* Add to the END of the linked list of Body structs. This is important so
      * the latter bodies are rendered on top of the previous ones. */
@@ -198,9 +459,46 @@ static void add_body(float x, float y, EBodyType type) {
         bodies = new_body;
     } else {
         /* Otherwise, append to the linked list */
-        Body* last_body = get_last_body();
         last_body->next = new_body;
     }
+    last_body = new_body;
+}
+
+/* Whether the body attracts others in the gravity solvers. Static bodies don't
+ * when the static field cache is enabled, since `apply_static_field' handles
+ * them. */
+static inline bool is_source(const Body* body) {
+    return !static_cache || body->type != BODY_STATIC;
+}
+
+/* Remove `body' from the linked list, given the previous body, and add it to
+ * the free list. */
+static void retire_body(Body* prev, Body* body) {
+    if (prev == NULL)
+        bodies = body->next;
+    else
+        prev->next = body->next;
+
+    if (last_body == body)
+        last_body = prev;
+
+    body->next = free_list;
+    free_list  = body;
+}
+
+/* Attract body 'a' towards a mass at the specified offset and distance */
+static void attract(Body* a, float dx, float dy, float distance, float mass) {
+    /* Calculate the force, the magnitude of the acceleration, the acceleration
+     * angle, the acceleration vector, and add it to the velocity. */
+    float force = (a->mass * mass) / (distance * distance);
+    float acc   = force / a->mass;
+
+    float rad_ang = atan2f(dy, dx);
+    float acc_x   = acc * cosf(rad_ang);
+    float acc_y   = acc * sinf(rad_ang);
+
+    a->vel_x += acc_x * sim_dt;
+    a->vel_y += acc_y * sim_dt;
 }
 
 /* Calculate and apply gravity acceleration to body 'a', relative to 'b' */
@@ -226,7 +524,7 @@ static void apply_acceleration(Body* a, Body* b) {
     if (a_width + b_width >= distance) {
         /* The bodies are colliding.
          * Calculate the reflection angle and bounce back with the new
-         * velocity. */
+         * velocity, scaled by the bounce power. */
         float nx = dx / distance;
         float ny = dy / distance;
 
@@ -237,28 +535,315 @@ static void apply_acceleration(Body* a, Body* b) {
         float perpendicular_x = a->vel_x - nvx;
         float perpendicular_y = a->vel_y - nvy;
 
-        a->vel_x = perpendicular_x - nvx;
-        a->vel_y = perpendicular_y - nvy;
+        const float bounce = bounce_collisions ? current_bounce : 1.f;
+        a->vel_x           = perpendicular_x - bounce * nvx;
+        a->vel_y           = perpendicular_y - bounce * nvy;
         return;
     }
 
-    /* The bodies are not colliding, attract to each other.
-     * Calculate the force, the magnitude of the acceleration, the acceleration
-     * angle, the acceleration vector, and add it to the velocity. */
-    float force = (a->mass * b->mass) / (distance * distance);
-    float acc   = force / a->mass;
+    /* The bodies are not colliding, attract to each other */
+    attract(a, dx, dy, distance, b->mass);
+}
 
-    float rad_ang = atan2f(dy, dx);
-    float acc_x   = acc * cosf(rad_ang);
-    float acc_y   = acc * sinf(rad_ang);
+/* Whether the body is far enough from the window to be grouped in the far
+ * field */
+static inline bool is_far(const Body* body) {
+    return body->x < -FAR_FIELD_MARGIN || body->y < -FAR_FIELD_MARGIN ||
+           body->x >= GRID_W + FAR_FIELD_MARGIN ||
+           body->y >= GRID_H + FAR_FIELD_MARGIN;
+}
+
+/* Bodies grouped in the far field, with the Morton key of their leaf */
+typedef struct FarBody {
+    uint64_t key;
+    Body* body;
+} FarBody;
+
+/* Group of bodies in the same cell of a level of the far field tree. The cell
+ * coordinates are in units of the cells of that level. */
+typedef struct FarCell {
+    uint32_t cell_x, cell_y;
+    int level;
+    float x, y; /* Center of mass */
+    float mass;
+    size_t first, count; /* Bodies for the leaves, children for the rest */
+} FarCell;
+
+/* Quadtree of far field cells. The leaves are cells of FAR_FIELD_CELL pixels,
+ * and each level groups 2x2 cells of the previous one, until there is a
+ * single cell or FAR_FIELD_LEVELS are used. */
+typedef struct FarTree {
+    const FarBody* bodies; /* Sorted by key, see `far_tree_build' */
+    FarCell* cells;        /* Every level, starting from the leaves */
+    size_t num_cells;
+    size_t top; /* First cell of the last level */
+} FarTree;
+
+static int compare_far_bodies(const void* a, const void* b) {
+    const uint64_t key_a = ((const FarBody*)a)->key;
+    const uint64_t key_b = ((const FarBody*)b)->key;
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+/* Index of the far field leaf containing a coordinate. It's offset so it's
+ * never negative, and clamped to the size of the tree. */
+static inline uint32_t far_cell_coord(float coord) {
+    const float half = (float)(1u << (FAR_FIELD_LEVELS - 1));
+    const float cell =
+      fminf(fmaxf(floorf(coord / FAR_FIELD_CELL), -half), half - 1.f);
+    return (uint32_t)((int32_t)cell + (1 << (FAR_FIELD_LEVELS - 1)));
+}
+
+/* Spread the bits of `v', leaving a zero between each of them */
+static inline uint64_t far_spread_bits(uint32_t v) {
+    uint64_t x = v;
+    x          = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+    x          = (x | (x << 8)) & 0x00FF00FF00FF00FFull;
+    x          = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0Full;
+    x          = (x | (x << 2)) & 0x3333333333333333ull;
+    x          = (x | (x << 1)) & 0x5555555555555555ull;
+    return x;
+}
+
+/* Add `body' to the `list' that will be grouped with `far_tree_build' */
+static inline void add_far_body(FarBody* list, size_t* num, Body* body) {
+    list[*num].key = far_spread_bits(far_cell_coord(body->x)) |
+                     (far_spread_bits(far_cell_coord(body->y)) << 1);
+    list[*num].body = body;
+    (*num)++;
+}
+
+/* Add an empty cell to the end of `tree', making room for it if needed */
+static FarCell* far_tree_push(FarTree* tree, size_t* capacity,
+                              uint32_t cell_x, uint32_t cell_y, int level,
+                              size_t first) {
+    if (tree->num_cells >= *capacity) {
+        *capacity   = *capacity * 2 + 16;
+        tree->cells = realloc(tree->cells, *capacity * sizeof(FarCell));
+        if (!tree->cells)
+            die("Unable to allocate far field.");
+    }
+
+    FarCell* cell = &tree->cells[tree->num_cells++];
+    cell->cell_x  = cell_x;
+    cell->cell_y  = cell_y;
+    cell->level   = level;
+    cell->x       = 0.f;
+    cell->y       = 0.f;
+    cell->mass    = 0.f;
+    cell->first   = first;
+    cell->count   = 0;
+    return cell;
+}
+
+/*
+ * Sort the bodies in `list' by leaf, and build the tree of their groups. Since
+ * the keys interleave the bits of both coordinates, the children of each cell
+ * are contiguous in the previous level, so the tree is built from the leaves
+ * up. The tree keeps a pointer to `list'.
+ */
+static void far_tree_build(FarTree* tree, FarBody* list, size_t num) {
+    qsort(list, num, sizeof(FarBody), compare_far_bodies);
+
+    tree->bodies    = list;
+    tree->cells     = NULL;
+    tree->num_cells = 0;
+    size_t capacity = 0;
+
+    /* The centers of mass are weighted sums until the end */
+    for (size_t i = 0; i < num; i++) {
+        Body* body = list[i].body;
+
+        if (i == 0 || list[i].key != list[i - 1].key)
+            far_tree_push(tree, &capacity, far_cell_coord(body->x),
+                          far_cell_coord(body->y), 0, i);
+
+        FarCell* cell = &tree->cells[tree->num_cells - 1];
+        cell->x += body->x * body->mass;
+        cell->y += body->y * body->mass;
+        cell->mass += body->mass;
+        cell->count++;
+    }
+
+    size_t first = 0, end = tree->num_cells;
+    for (int level = 1; end - first > 1 && level < FAR_FIELD_LEVELS; level++) {
+        for (size_t c = first; c < end; c++) {
+            const uint32_t cell_x = tree->cells[c].cell_x >> 1;
+            const uint32_t cell_y = tree->cells[c].cell_y >> 1;
+            const FarCell* last   = &tree->cells[tree->num_cells - 1];
+
+            if (c == first || last->cell_x != cell_x || last->cell_y != cell_y)
+                far_tree_push(tree, &capacity, cell_x, cell_y, level, c);
+
+            FarCell* parent     = &tree->cells[tree->num_cells - 1];
+            const FarCell* cell = &tree->cells[c];
+            parent->x += cell->x;
+            parent->y += cell->y;
+            parent->mass += cell->mass;
+            parent->count++;
+        }
+
+        first = end;
+        end   = tree->num_cells;
+    }
+    tree->top = first;
+
+    for (size_t c = 0; c < tree->num_cells; c++) {
+        tree->cells[c].x /= tree->cells[c].mass;
+        tree->cells[c].y /= tree->cells[c].mass;
+    }
+}
+
+static void far_tree_free(FarTree* tree) {
+    free(tree->cells);
+    tree->cells     = NULL;
+    tree->num_cells = 0;
+}
+
+/*
+ * Attract `a' towards the bodies in `tree'. A cell is only treated as a single
+ * body at its center of mass when it's well separated from `a', that is, when
+ * it's not next to the cell of `a' in its level and its size is below
+ * FAR_FIELD_THETA times its distance. Otherwise, its children are checked, and
+ * the bodies of the leaves are calculated one by one, with collisions.
+ */
+static void attract_cells(Body* a, const FarTree* tree) {
+    const uint32_t cell_x = far_cell_coord(a->x);
+    const uint32_t cell_y = far_cell_coord(a->y);
+
+    /* Each level adds at most 4 cells to the stack */
+    size_t stack[4 * FAR_FIELD_LEVELS];
+    for (size_t top = tree->top; top < tree->num_cells; top++) {
+        int depth      = 0;
+        stack[depth++] = top;
+
+        while (depth > 0) {
+            const FarCell* cell = &tree->cells[stack[--depth]];
+
+            const float dx       = cell->x - a->x;
+            const float dy       = cell->y - a->y;
+            const float distance = sqrtf(dx * dx + dy * dy);
+            const float size     = ldexpf(FAR_FIELD_CELL, cell->level);
+
+            /* Unsigned, so avoid negative differences */
+            const uint32_t x    = cell_x >> cell->level;
+            const uint32_t y    = cell_y >> cell->level;
+            const bool adjacent = cell->cell_x + 1 >= x &&
+                                  cell->cell_x <= x + 1 &&
+                                  cell->cell_y + 1 >= y &&
+                                  cell->cell_y <= y + 1;
+
+            if (!adjacent && size < FAR_FIELD_THETA * distance) {
+                attract(a, dx, dy, distance, cell->mass);
+                continue;
+            }
+
+            const size_t end = cell->first + cell->count;
+            if (cell->level > 0) {
+                for (size_t c = cell->first; c < end; c++)
+                    stack[depth++] = c;
+                continue;
+            }
+
+            for (size_t i = cell->first; i < end; i++)
+                if (tree->bodies[i].body != a)
+                    apply_acceleration(a, tree->bodies[i].body);
+        }
+    }
+}
+
+/*
+ * Calculate and apply gravity accelerations when some bodies are far from the
+ * window. Both the near and the far bodies are grouped in a tree of cells, and
+ * cells that are well separated from a body are treated as a single body, see
+ * `attract_cells':
+ *
+ *   - Bodies near the window are attracted by every near body, and by the
+ *     far cells.
+ *   - Far bodies are attracted by the near cells and by the far cells,
+ *     including their own.
+ *
+ * This way, escaped bodies don't make the pairwise loop quadratic, and bodies
+ * that are close to each other are always calculated directly, so they also
+ * collide across the border of the far field or of a cell.
+ */
+static void apply_accelerations_far(size_t num_near, size_t num_far) {
+    Body** near        = malloc((num_near + 1) * sizeof(Body*));
+    FarBody* near_list = malloc((num_near + 1) * sizeof(FarBody));
+    FarBody* far       = malloc(num_far * sizeof(FarBody));
+    if (!near || !near_list || !far)
+        die("Unable to allocate far field.");
+
+    /* The near bodies are also kept in order, since collisions depend on the
+     * order of the pairs */
+    num_near = num_far = 0;
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        if (!is_source(body))
+            continue;
+
+        if (is_far(body)) {
+            add_far_body(far, &num_far, body);
+        } else {
+            add_far_body(near_list, &num_near, body);
+            near[num_near - 1] = body;
+        }
+    }
+
+    FarTree near_tree, far_tree;
+    far_tree_build(&near_tree, near_list, num_near);
+    far_tree_build(&far_tree, far, num_far);
+
+    for (size_t i = 0; i < num_near; i++) {
+        Body* a = near[i];
+
+        /* Static bodies don't move */
+        if (a->type == BODY_STATIC)
+            continue;
+
+        for (size_t j = 0; j < num_near; j++)
+            if (i != j)
+                apply_acceleration(a, near[j]);
 
-    a->vel_x += acc_x;
-    a->vel_y += acc_y;
+        attract_cells(a, &far_tree);
+    }
+
+    for (size_t i = 0; i < num_far; i++) {
+        Body* a = far[i].body;
+        if (a->type == BODY_STATIC)
+            continue;
+
+        attract_cells(a, &near_tree);
+        attract_cells(a, &far_tree);
+    }
+
+    far_tree_free(&far_tree);
+    far_tree_free(&near_tree);
+    free(far);
+    free(near_list);
+    free(near);
 }
 
 /* Calculate and apply gravity accelerations to all bodies relative to all
  * bodies. */
 static void apply_accelerations(void) {
+    /* Bodies that escaped far from the window are grouped, so they don't take
+     * part in the pairwise loop */
+    size_t num_near = 0, num_far = 0;
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        if (!is_source(body))
+            continue;
+
+        if (is_far(body))
+            num_far++;
+        else
+            num_near++;
+    }
+
+    if (far_field && num_far > 0) {
+        apply_accelerations_far(num_near, num_far);
+        return;
+    }
+
     /* NOTE: This is a very bad iterative method, since some operations are
      * repeated. However, it's more clear this way, so I decided to leave it
      * like this. */
@@ -268,7 +853,7 @@ static void apply_accelerations(void) {
             continue;
 
         for (Body* b = bodies; b != NULL; b = b->next) {
-            if (a == b)
+            if (a == b || !is_source(b))
                 continue;
 
             apply_acceleration(a, b);
@@ -276,169 +861,3632 @@ static void apply_accelerations(void) {
     }
 }
 
-static void move_bodies(void) {
-    for (Body* body = bodies; body != NULL; body = body->next) {
-        /* Static bodies don't move */
-        if (body->type == BODY_STATIC)
-            continue;
+/*----------------------------------------------------------------------------*/
+/* Fast Multipole Method */
+
+/*
+ * The attraction in `apply_acceleration' falls with the square of the
+ * distance. In 2D that is not the gradient of an analytic function, so the
+ * usual complex-valued expansions (which assume a logarithmic potential) don't
+ * apply. Instead, the acceleration is the gradient of the 3D potential
+ *
+ *   psi(p) = sum(m_j / |p - p_j|)
+ *
+ * restricted to the plane, which we expand with Cartesian Taylor series in X
+ * and Y. The term with exponents (i, j) is stored at FMM_IDX(i, j), so the same
+ * layout can be used for any order.
+ */
+#define FMM_IDX(I, J) (((I) + (J)) * ((I) + (J) + 1) / 2 + (J))
+#define FMM_TERMS(P)  (((P) + 1) * ((P) + 2) / 2)
+
+/* Binomial coefficients, filled by `fmm_init_binomials' */
+static double fmm_binom[2 * FMM_MAX_ORDER + 1][2 * FMM_MAX_ORDER + 1];
 
-        body->x += body->vel_x;
-        body->y += body->vel_y;
+static void fmm_init_binomials(void) {
+    static bool initialized = false;
+    if (initialized)
+        return;
+
+    for (int n = 0; n <= 2 * FMM_MAX_ORDER; n++) {
+        fmm_binom[n][0] = 1.0;
+        for (int k = 1; k <= n; k++)
+            fmm_binom[n][k] =
+              fmm_binom[n - 1][k - 1] + (k < n ? fmm_binom[n - 1][k] : 0.0);
     }
+
+    initialized = true;
 }
 
-static void render_grid(SDL_Renderer* rend) {
-    for (Body* body = bodies; body != NULL; body = body->next) {
-        assert(body->type < LENGTH(color_palette));
+/*
+ * Fill `t' with the Taylor coefficients of 1/|r| around (x, y), up to order
+ * `p'. That is, the derivatives divided by the factorials of the exponents.
+ * They are calculated with the recurrence:
+ *
+ *   n*r^2*T(k) + (2n-1)*sum(x_i*T(k-e_i)) + (n-1)*sum(T(k-2*e_i)) = 0
+ */
+static void fmm_taylor_coefs(double* t, double x, double y, int p) {
+    const double r2 = x * x + y * y;
 
-        /* Round float positions to get the grid coordinates */
-        const int x = (int)roundf(body->x);
-        const int y = (int)roundf(body->y);
+    t[0] = 1.0 / sqrt(r2);
+    for (int n = 1; n <= p; n++) {
+        for (int j = 0; j <= n; j++) {
+            const int i = n - j;
 
-        /* Round mass to get the circle radius */
-        const int radius = (int)roundf(body->mass);
+            double sum = 0.0;
+            if (i >= 1)
+                sum += (2 * n - 1) * x * t[FMM_IDX(i - 1, j)];
+            if (j >= 1)
+                sum += (2 * n - 1) * y * t[FMM_IDX(i, j - 1)];
+            if (i >= 2)
+                sum += (n - 1) * t[FMM_IDX(i - 2, j)];
+            if (j >= 2)
+                sum += (n - 1) * t[FMM_IDX(i, j - 2)];
 
-        const uint32_t color = color_palette[body->type];
+            t[FMM_IDX(i, j)] = -sum / (n * r2);
+        }
+    }
+}
 
-        if (body->type == BODY_STATIC)
-            draw_circle(rend, x, y, radius, color);
-        else
-            draw_circle_filled(rend, x, y, radius, color);
+/* Fill `out' with x^0..x^p */
+static inline void fmm_powers(double* out, double x, int p) {
+    out[0] = 1.0;
+    for (int i = 1; i <= p; i++)
+        out[i] = out[i - 1] * x;
+}
+
+/* Shift the multipole expansion `src' by (dx, dy), adding it to `dst' */
+static void fmm_m2m(double* dst, const double* src, double dx, double dy,
+                    int p) {
+    double px[FMM_MAX_ORDER + 1], py[FMM_MAX_ORDER + 1];
+    fmm_powers(px, dx, p);
+    fmm_powers(py, dy, p);
+
+    for (int n = 0; n <= p; n++) {
+        for (int j = 0; j <= n; j++) {
+            const int i = n - j;
+
+            double sum = 0.0;
+            for (int a = 0; a <= i; a++)
+                for (int b = 0; b <= j; b++)
+                    sum += fmm_binom[i][a] * fmm_binom[j][b] * px[i - a] *
+                           py[j - b] * src[FMM_IDX(a, b)];
+
+            dst[FMM_IDX(i, j)] += sum;
+        }
     }
 }
 
-static void free_bodies(void) {
-    Body* body = bodies;
-    while (body != NULL) {
-        Body* aux = body->next;
-        free(body);
-        body = aux;
+/* Convert the multipole expansion `mp' into a local expansion, given the
+ * Taylor coefficients `t' of the offset between both centers. */
+static void fmm_m2l(double* local, const double* mp, const double* t, int p) {
+    for (int n = 0; n <= p; n++) {
+        for (int nj = 0; nj <= n; nj++) {
+            const int ni = n - nj;
+
+            double sum = 0.0;
+            for (int k = 0; k <= p; k++) {
+                const double sign = (k & 1) ? -1.0 : 1.0;
+                for (int kj = 0; kj <= k; kj++) {
+                    const int ki = k - kj;
+                    sum += sign * fmm_binom[ki + ni][ni] *
+                           fmm_binom[kj + nj][nj] * mp[FMM_IDX(ki, kj)] *
+                           t[FMM_IDX(ki + ni, kj + nj)];
+                }
+            }
+
+            local[FMM_IDX(ni, nj)] += sum;
+        }
     }
-    bodies = NULL;
 }
 
-/*----------------------------------------------------------------------------*/
+/* Shift the local expansion `src' by (dx, dy), adding it to `dst' */
+static void fmm_l2l(double* dst, const double* src, double dx, double dy,
+                    int p) {
+    double px[FMM_MAX_ORDER + 1], py[FMM_MAX_ORDER + 1];
+    fmm_powers(px, dx, p);
+    fmm_powers(py, dy, p);
 
-int main(void) {
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) != 0)
-        die("Unable to start SDL.");
+    for (int n = 0; n <= p; n++) {
+        for (int j = 0; j <= n; j++) {
+            const int i = n - j;
 
-    /* Create SDL window */
-    SDL_Window* sdl_window =
-      SDL_CreateWindow("Orbit", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-                       GRID_W, GRID_H, 0);
-    if (!sdl_window)
-        die("Error creating SDL window.");
+            double sum = 0.0;
+            for (int a = i; a <= p; a++)
+                for (int b = j; a + b <= p; b++)
+                    sum += fmm_binom[a][i] * fmm_binom[b][j] * px[a - i] *
+                           py[b - j] * src[FMM_IDX(a, b)];
 
-    /* Create SDL renderer */
-    SDL_Renderer* sdl_renderer =
-      SDL_CreateRenderer(sdl_window, -1,
-                         SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-    if (!sdl_renderer) {
-        SDL_DestroyWindow(sdl_window);
-        die("Error creating SDL renderer.");
+            dst[FMM_IDX(i, j)] += sum;
+        }
+    }
+}
+
+/* Add the local expansion of a body with mass `mass' to `local', given the
+ * Taylor coefficients `t' of the offset from the body to the center. */
+static void fmm_p2l(double* local, double mass, const double* t, int p) {
+    for (int n = 0; n < FMM_TERMS(p); n++)
+        local[n] += mass * t[n];
+}
+
+/* Evaluate the acceleration caused by the multipole expansion `mp' at a point,
+ * given the Taylor coefficients `t' of the offset from the center to the
+ * point, up to order p + 1. This is `fmm_m2l' followed by the gradient at the
+ * center of the local expansion, without the terms that don't affect it. */
+static void fmm_m2p(const double* mp, const double* t, int p, double* acc_x,
+                    double* acc_y) {
+    for (int k = 0; k <= p; k++) {
+        const double sign = (k & 1) ? -1.0 : 1.0;
+        for (int kj = 0; kj <= k; kj++) {
+            const int ki = k - kj;
+            *acc_x += sign * (ki + 1) * mp[FMM_IDX(ki, kj)] *
+                      t[FMM_IDX(ki + 1, kj)];
+            *acc_y += sign * (kj + 1) * mp[FMM_IDX(ki, kj)] *
+                      t[FMM_IDX(ki, kj + 1)];
+        }
     }
+}
 
-    /* Main loop */
-    bool clear_bodies = false;
-    bool running      = true;
-    while (running) {
-        /* Parse SDL events */
-        SDL_Event sdl_event;
-        while (SDL_PollEvent(&sdl_event)) {
-            switch (sdl_event.type) {
-                case SDL_QUIT:
-                    running = false;
-                    break;
-                case SDL_KEYDOWN:
-                    switch (sdl_event.key.keysym.scancode) {
-                        case SDL_SCANCODE_ESCAPE:
-                        case SDL_SCANCODE_Q:
-                            running = false;
-                            break;
-                        case SDL_SCANCODE_C:
-                            clear_bodies = true;
-                            break;
-                        case SDL_SCANCODE_1:
-                            current_mass -= CURRENT_MASS_STEP;
-                            break;
-                        case SDL_SCANCODE_2:
-                            current_mass += CURRENT_MASS_STEP;
-                            break;
-                        case SDL_SCANCODE_3:
-                            current_bounce -= CURRENT_BOUNCE_STEP;
-                            break;
-                        case SDL_SCANCODE_4:
-                            current_bounce += CURRENT_BOUNCE_STEP;
-                            break;
-                        default:
-                            break;
-                    }      /* End scancode switch */
-                    break; /* End SDL_KEYDOWN case */
-                case SDL_MOUSEBUTTONUP: {
-                    const int mouse_x = sdl_event.motion.x;
-                    const int mouse_y = sdl_event.motion.y;
-
-                    switch (sdl_event.button.button) {
-                        case SDL_BUTTON_LEFT:
-                            add_body(mouse_x, mouse_y, BODY_DYNAMIC);
-                            break;
-                        case SDL_BUTTON_RIGHT:
-                            add_body(mouse_x, mouse_y, BODY_STATIC);
-                            break;
-                        default:
-                            break;
-                    }    /* End mouse button switch */
-                } break; /* End SDL_MOUSEBUTTON case */
-                case SDL_MOUSEWHEEL:
-                    if (sdl_event.wheel.type != SDL_MOUSEWHEEL)
-                        break;
-
-                    /* Increase or decrease current mass with mouse wheel */
-                    if (sdl_event.wheel.y > 0)
-                        current_mass += CURRENT_MASS_STEP;
-                    else
-                        current_mass -= CURRENT_MASS_STEP;
-
-                    break; /* End SDL_MOUSEWHEEL case */
-                default:
-                    break;
-            } /* End event.type switch */
-        }     /* End PollEvent while */
+/*
+ * Calculate and apply gravity accelerations to all bodies using the Fast
+ * Multipole Method over a uniform quadtree. Bodies in the same or adjacent
+ * leaves are handled by `apply_acceleration', so collisions still work.
+ *
+ * The tree only covers the bodies near the window (see `is_far'), so a few
+ * escaped bodies don't stretch its leaves. Each of those outliers walks the
+ * tree from the root: cells at least FMM_OUTLIER_SEPARATION times their side
+ * away from it (plus the collision distance) receive its field in their local
+ * expansion, and give it theirs from their multipole expansion. The leaves
+ * closer than that are calculated directly, and the outliers between them are
+ * grouped as in `apply_accelerations_far'.
+ */
+static void apply_fmm(void) {
+    const int p     = fmm_order;
+    const int terms = FMM_TERMS(p);
 
-        /* If we pressed 'C' */
-        if (clear_bodies) {
-            free_bodies();
-            clear_bodies = false;
+    fmm_init_binomials();
+
+    /* Count the bodies and get the bounds of the tree */
+    size_t num_bodies = 0, num_outliers = 0;
+    float min_x = INFINITY, min_y = INFINITY;
+    float max_x = -INFINITY, max_y = -INFINITY;
+    float max_mass = 0.f;
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        if (!is_source(body))
+            continue;
+
+        if (is_far(body)) {
+            num_outliers++;
             continue;
         }
 
-        /* Make sure the global variables are within bounds */
-        if (current_mass < 1.f)
-            current_mass = 1.f;
-        if (current_bounce < 0.f)
-            current_bounce = 0.f;
+        num_bodies++;
+        max_mass = fmaxf(max_mass, body->mass);
+        min_x    = fminf(min_x, body->x);
+        min_y    = fminf(min_y, body->y);
+        max_x    = fmaxf(max_x, body->x);
+        max_y    = fmaxf(max_y, body->y);
+    }
 
-        /* Clear window */
-        set_render_color(sdl_renderer, 0x000000);
-        SDL_RenderClear(sdl_renderer);
+    /* Every body escaped, there is no dense region for the tree */
+    if (num_bodies == 0) {
+        apply_accelerations();
+        return;
+    }
 
-        /* Calculate and apply the gravity accelerations to each body */
+    /* Pick the depth so leaves have around FMM_LEAF_SIZE bodies, but make sure
+     * colliding bodies are always in adjacent leaves. */
+    double side = fmax(max_x - min_x, max_y - min_y) * 1.0001 + 1.0;
+    int levels  = 2;
+    while (levels < FMM_MAX_LEVEL &&
+           ((size_t)FMM_LEAF_SIZE << (2 * levels)) < num_bodies)
+        levels++;
+    while (levels >= 2 && side / (1 << levels) < 2.0 * max_mass)
+        levels--;
+
+    /* Not worth it, or the bodies are too big for the tree */
+    if (levels < 2) {
         apply_accelerations();
+        return;
+    }
 
-        /* Apply the velocity of each body */
-        move_bodies();
+    /* Allocate every level of the tree */
+    int* counts[FMM_MAX_LEVEL + 1];
+    double* mps[FMM_MAX_LEVEL + 1];
+    double* locals[FMM_MAX_LEVEL + 1];
+    for (int l = 0; l <= levels; l++) {
+        const size_t cells = (size_t)1 << (2 * l);
+        counts[l]          = calloc(cells, sizeof(int));
+        mps[l]             = calloc(cells * terms, sizeof(double));
+        locals[l]          = calloc(cells * terms, sizeof(double));
+        if (!counts[l] || !mps[l] || !locals[l])
+            die("Unable to allocate FMM tree.");
+    }
 
-        /* Render the valid bodies */
-        render_grid(sdl_renderer);
+    /* Sort the bodies by leaf, with a counting sort */
+    const int leaf_n       = 1 << levels;
+    const double leaf_side = side / leaf_n;
+    const size_t leaves    = (size_t)leaf_n * leaf_n;
 
-        /* Send to renderer and delay depending on FPS */
-        SDL_RenderPresent(sdl_renderer);
-        SDL_Delay(1000 / FPS);
+    Body** sorted     = malloc(num_bodies * sizeof(Body*));
+    int* body_leaf    = malloc(num_bodies * sizeof(int));
+    size_t* leaf_start = calloc(leaves + 1, sizeof(size_t));
+    if (!sorted || !body_leaf || !leaf_start)
+        die("Unable to allocate FMM tree.");
+
+    Body** outliers = malloc((num_outliers + 1) * sizeof(Body*));
+    if (!outliers)
+        die("Unable to allocate FMM tree.");
+
+    size_t i = 0, o = 0;
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        if (!is_source(body))
+            continue;
+
+        if (is_far(body)) {
+            outliers[o++] = body;
+            continue;
+        }
+
+        const int lx = (int)((body->x - min_x) / leaf_side);
+        const int ly = (int)((body->y - min_y) / leaf_side);
+        body_leaf[i] = ly * leaf_n + lx;
+        leaf_start[body_leaf[i] + 1]++;
+        i++;
+    }
+    for (size_t leaf = 0; leaf < leaves; leaf++)
+        leaf_start[leaf + 1] += leaf_start[leaf];
+
+    {
+        size_t* fill = malloc(leaves * sizeof(size_t));
+        if (!fill)
+            die("Unable to allocate FMM tree.");
+        memcpy(fill, leaf_start, leaves * sizeof(size_t));
+
+        i = 0;
+        for (Body* body = bodies; body != NULL; body = body->next)
+            if (is_source(body) && !is_far(body))
+                sorted[fill[body_leaf[i++]]++] = body;
+
+        free(fill);
+    }
+
+    /* Particle to multipole, on the leaves */
+    double px[FMM_MAX_ORDER + 1], py[FMM_MAX_ORDER + 1];
+    for (int ly = 0; ly < leaf_n; ly++) {
+        for (int lx = 0; lx < leaf_n; lx++) {
+            const size_t leaf = (size_t)ly * leaf_n + lx;
+            const double cx   = min_x + (lx + 0.5) * leaf_side;
+            const double cy   = min_y + (ly + 0.5) * leaf_side;
+            double* mp        = &mps[levels][leaf * terms];
+
+            counts[levels][leaf] = leaf_start[leaf + 1] - leaf_start[leaf];
+            for (size_t b = leaf_start[leaf]; b < leaf_start[leaf + 1]; b++) {
+                fmm_powers(px, sorted[b]->x - cx, p);
+                fmm_powers(py, sorted[b]->y - cy, p);
+                for (int n = 0; n <= p; n++)
+                    for (int j = 0; j <= n; j++)
+                        mp[FMM_IDX(n - j, j)] +=
+                          sorted[b]->mass * px[n - j] * py[j];
+            }
+        }
     }
 
+    /* Multipole to multipole, from the leaves to the root */
+    for (int l = levels - 1; l >= 0; l--) {
+        const int n           = 1 << l;
+        const double child_side = side / (n * 2);
+
+        for (int y = 0; y < n * 2; y++) {
+            for (int x = 0; x < n * 2; x++) {
+                const size_t child  = (size_t)y * n * 2 + x;
+                const size_t parent = (size_t)(y / 2) * n + x / 2;
+                if (counts[l + 1][child] == 0)
+                    continue;
+
+                /* Offset from the parent center to the child center */
+                const double dx = ((x & 1) ? 0.5 : -0.5) * child_side;
+                const double dy = ((y & 1) ? 0.5 : -0.5) * child_side;
+
+                counts[l][parent] += counts[l + 1][child];
+                fmm_m2m(&mps[l][parent * terms], &mps[l + 1][child * terms],
+                        dx, dy, p);
+            }
+        }
+    }
+
+    /* Multipole to local. The interaction list of a cell is made of the
+     * children of its parent's neighbours that are not adjacent to it. Since
+     * the offsets are always the same for a given level, the Taylor
+     * coefficients are calculated only once. */
+    double* taylor = malloc(7 * 7 * FMM_TERMS(2 * p) * sizeof(double));
+    if (!taylor)
+        die("Unable to allocate FMM tree.");
+
+    /* Outliers against the tree, before the local expansions are shifted to
+     * the leaves. The stack has room for the 4 children of every level. */
+    for (o = 0; o < num_outliers; o++) {
+        Body* a = outliers[o];
+        double acc_x = 0.0, acc_y = 0.0;
+
+        /* Bodies in separated cells can't be colliding with the outlier */
+        const double reach = a->mass + max_mass;
+
+        int stack[4 * (FMM_MAX_LEVEL + 1)][3];
+        int top = 0;
+        stack[top][0] = stack[top][1] = stack[top][2] = 0;
+        top++;
+
+        while (top > 0) {
+            top--;
+            const int l = stack[top][0], x = stack[top][1], y = stack[top][2];
+            const int n = 1 << l;
+            const size_t cell = (size_t)y * n + x;
+            if (counts[l][cell] == 0)
+                continue;
+
+            const double cell_side = side / n;
+            const double cx        = min_x + (x + 0.5) * cell_side;
+            const double cy        = min_y + (y + 0.5) * cell_side;
+            const double dx        = a->x - cx;
+            const double dy        = a->y - cy;
+
+            const double separation =
+              FMM_OUTLIER_SEPARATION * cell_side + reach;
+            if (dx * dx + dy * dy >= separation * separation) {
+                /* From the cell to the outlier */
+                if (a->type != BODY_STATIC) {
+                    fmm_taylor_coefs(taylor, dx, dy, p + 1);
+                    fmm_m2p(&mps[l][cell * terms], taylor, p, &acc_x, &acc_y);
+                }
+
+                /* From the outlier to the cell */
+                fmm_taylor_coefs(taylor, -dx, -dy, p);
+                fmm_p2l(&locals[l][cell * terms], a->mass, taylor, p);
+                continue;
+            }
+
+            if (l < levels) {
+                for (int c = 0; c < 4; c++) {
+                    stack[top][0] = l + 1;
+                    stack[top][1] = x * 2 + (c & 1);
+                    stack[top][2] = y * 2 + (c >> 1);
+                    top++;
+                }
+                continue;
+            }
+
+            /* A leaf too close to the outlier */
+            for (size_t b = leaf_start[cell]; b < leaf_start[cell + 1]; b++) {
+                if (a->type != BODY_STATIC)
+                    apply_acceleration(a, sorted[b]);
+                if (sorted[b]->type != BODY_STATIC)
+                    apply_acceleration(sorted[b], a);
+            }
+        }
+
+        a->vel_x += acc_x * sim_dt;
+        a->vel_y += acc_y * sim_dt;
+    }
+
+    /* Outliers between them, grouped in a tree so many escaped bodies don't
+     * make it quadratic */
+    {
+        FarBody* list = malloc((num_outliers + 1) * sizeof(FarBody));
+        if (!list)
+            die("Unable to allocate FMM tree.");
+
+        size_t num_list = 0;
+        for (o = 0; o < num_outliers; o++)
+            add_far_body(list, &num_list, outliers[o]);
+
+        FarTree tree;
+        far_tree_build(&tree, list, num_list);
+        for (o = 0; o < num_outliers; o++)
+            if (outliers[o]->type != BODY_STATIC)
+                attract_cells(outliers[o], &tree);
+
+        far_tree_free(&tree);
+        free(list);
+    }
+
+    /* The first two levels don't have interaction lists, but they can have
+     * local expansions from the outliers */
+    for (int l = 0; l <= levels; l++) {
+        const int n            = 1 << l;
+        const double cell_side = side / n;
+
+        for (int oy = -3; oy <= 3; oy++)
+            for (int ox = -3; ox <= 3; ox++)
+                if (abs(ox) > 1 || abs(oy) > 1)
+                    fmm_taylor_coefs(
+                      &taylor[((oy + 3) * 7 + ox + 3) * FMM_TERMS(2 * p)],
+                      ox * cell_side, oy * cell_side, 2 * p);
+
+        for (int ty = 0; ty < n; ty++) {
+            for (int tx = 0; tx < n; tx++) {
+                const size_t target = (size_t)ty * n + tx;
+                if (counts[l][target] == 0)
+                    continue;
+
+                const int first_x = (tx / 2 - 1) * 2;
+                const int first_y = (ty / 2 - 1) * 2;
+                for (int sy = first_y; sy < first_y + 6; sy++) {
+                    for (int sx = first_x; sx < first_x + 6; sx++) {
+                        if (sx < 0 || sy < 0 || sx >= n || sy >= n)
+                            continue;
+                        if (abs(sx - tx) <= 1 && abs(sy - ty) <= 1)
+                            continue;
+
+                        const size_t source = (size_t)sy * n + sx;
+                        if (counts[l][source] == 0)
+                            continue;
+
+                        /* Offset from the source to the target */
+                        const int ox = tx - sx, oy = ty - sy;
+                        fmm_m2l(&locals[l][target * terms],
+                                &mps[l][source * terms],
+                                &taylor[((oy + 3) * 7 + ox + 3) *
+                                        FMM_TERMS(2 * p)],
+                                p);
+                    }
+                }
+            }
+        }
+
+        /* Local to local, into the children of this level */
+        if (l == levels)
+            break;
+
+        for (int y = 0; y < n * 2; y++) {
+            for (int x = 0; x < n * 2; x++) {
+                const size_t child  = (size_t)y * n * 2 + x;
+                const size_t parent = (size_t)(y / 2) * n + x / 2;
+                if (counts[l + 1][child] == 0)
+                    continue;
+
+                const double dx = ((x & 1) ? 0.25 : -0.25) * cell_side;
+                const double dy = ((y & 1) ? 0.25 : -0.25) * cell_side;
+                fmm_l2l(&locals[l + 1][child * terms],
+                        &locals[l][parent * terms], dx, dy, p);
+            }
+        }
+    }
+
+    free(taylor);
+
+    /* Direct interactions with the adjacent leaves, and local expansion to
+     * particle. The acceleration is the gradient of the local expansion. */
+    for (int ly = 0; ly < leaf_n; ly++) {
+        for (int lx = 0; lx < leaf_n; lx++) {
+            const size_t leaf   = (size_t)ly * leaf_n + lx;
+            const double cx     = min_x + (lx + 0.5) * leaf_side;
+            const double cy     = min_y + (ly + 0.5) * leaf_side;
+            const double* local = &locals[levels][leaf * terms];
+
+            for (size_t t = leaf_start[leaf]; t < leaf_start[leaf + 1]; t++) {
+                Body* a = sorted[t];
+
+                /* Static bodies don't move */
+                if (a->type == BODY_STATIC)
+                    continue;
+
+                for (int ny = ly - 1; ny <= ly + 1; ny++) {
+                    for (int nx = lx - 1; nx <= lx + 1; nx++) {
+                        if (nx < 0 || ny < 0 || nx >= leaf_n || ny >= leaf_n)
+                            continue;
+
+                        const size_t near = (size_t)ny * leaf_n + nx;
+                        for (size_t s = leaf_start[near];
+                             s < leaf_start[near + 1]; s++)
+                            if (sorted[s] != a)
+                                apply_acceleration(a, sorted[s]);
+                    }
+                }
+
+                fmm_powers(px, a->x - cx, p);
+                fmm_powers(py, a->y - cy, p);
+
+                double acc_x = 0.0, acc_y = 0.0;
+                for (int n = 1; n <= p; n++) {
+                    for (int j = 0; j <= n; j++) {
+                        const int i = n - j;
+                        if (i >= 1)
+                            acc_x += i * local[FMM_IDX(i, j)] * px[i - 1] *
+                                     py[j];
+                        if (j >= 1)
+                            acc_y += j * local[FMM_IDX(i, j)] * px[i] *
+                                     py[j - 1];
+                    }
+                }
+
+                a->vel_x += acc_x * sim_dt;
+                a->vel_y += acc_y * sim_dt;
+            }
+        }
+    }
+
+    for (int l = 0; l <= levels; l++) {
+        free(counts[l]);
+        free(mps[l]);
+        free(locals[l]);
+    }
+    free(leaf_start);
+    free(body_leaf);
+    free(sorted);
+    free(outliers);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Particle-mesh solver */
+
+/*
+ * Mesh used by `apply_pm'. The nodes are `h' pixels apart, starting at (0, 0)
+ * and covering GRID_W and GRID_H. The arrays are twice the size in each axis,
+ * and the second half is left empty, so the circular convolution of the FFT
+ * doesn't wrap around (bounded domain).
+ */
+typedef struct PmMesh {
+    int nodes_x, nodes_y; /* Nodes covering the window */
+    int w, h;             /* Size of the padded arrays, powers of two */
+    float spacing;        /* Pixels between nodes */
+    float split;          /* Scale of the force split of P3M, 0 if none */
+
+    /* Kernel for offsets of up to `pair_radius' nodes in each axis, used for
+     * removing the mesh force of close pairs, see `pm_pair' */
+    int pair_radius;
+    float *pair_x, *pair_y;
+
+    /* Transform of the X and Y components of the kernel */
+    double *kernel_x_re, *kernel_x_im;
+    double *kernel_y_re, *kernel_y_im;
+
+    /* Density and acceleration fields */
+    double *rho_re, *rho_im;
+    double *acc_x_re, *acc_x_im;
+    double *acc_y_re, *acc_y_im;
+} PmMesh;
+
+static PmMesh pm_mesh;
+
+static int next_pow2(int n) {
+    int result = 1;
+    while (result < n)
+        result <<= 1;
+    return result;
+}
+
+/* In-place iterative radix-2 FFT of `n' complex values */
+static void fft(double* re, double* im, int n, bool inverse) {
+    /* Bit-reversal permutation */
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+
+        if (i < j) {
+            double tmp = re[i];
+            re[i]      = re[j];
+            re[j]      = tmp;
+            tmp        = im[i];
+            im[i]      = im[j];
+            im[j]      = tmp;
+        }
+    }
+
+    for (int len = 2; len <= n; len <<= 1) {
+        const double angle = (inverse ? 2.0 : -2.0) * M_PI / len;
+        const double w_re  = cos(angle);
+        const double w_im  = sin(angle);
+
+        for (int i = 0; i < n; i += len) {
+            double cur_re = 1.0, cur_im = 0.0;
+            for (int k = 0; k < len / 2; k++) {
+                const int a = i + k, b = i + k + len / 2;
+
+                const double v_re = re[b] * cur_re - im[b] * cur_im;
+                const double v_im = re[b] * cur_im + im[b] * cur_re;
+                re[b]             = re[a] - v_re;
+                im[b]             = im[a] - v_im;
+                re[a] += v_re;
+                im[a] += v_im;
+
+                const double next_re = cur_re * w_re - cur_im * w_im;
+                cur_im               = cur_re * w_im + cur_im * w_re;
+                cur_re               = next_re;
+            }
+        }
+    }
+
+    if (inverse) {
+        for (int i = 0; i < n; i++) {
+            re[i] /= n;
+            im[i] /= n;
+        }
+    }
+}
+
+/* 2D FFT of a `w'x`h' row-major array, rows first */
+static void fft_2d(double* re, double* im, int w, int h, bool inverse) {
+    for (int y = 0; y < h; y++)
+        fft(&re[y * w], &im[y * w], w, inverse);
+
+    double* col_re = malloc(h * sizeof(double));
+    double* col_im = malloc(h * sizeof(double));
+    if (!col_re || !col_im)
+        die("Unable to allocate PM mesh.");
+
+    for (int x = 0; x < w; x++) {
+        for (int y = 0; y < h; y++) {
+            col_re[y] = re[y * w + x];
+            col_im[y] = im[y * w + x];
+        }
+
+        fft(col_re, col_im, h, inverse);
+
+        for (int y = 0; y < h; y++) {
+            re[y * w + x] = col_re[y];
+            im[y * w + x] = col_im[y];
+        }
+    }
+
+    free(col_re);
+    free(col_im);
+}
+
+static void pm_free(void) {
+    free(pm_mesh.kernel_x_re);
+    free(pm_mesh.kernel_x_im);
+    free(pm_mesh.kernel_y_re);
+    free(pm_mesh.kernel_y_im);
+    free(pm_mesh.rho_re);
+    free(pm_mesh.rho_im);
+    free(pm_mesh.acc_x_re);
+    free(pm_mesh.acc_x_im);
+    free(pm_mesh.acc_y_re);
+    free(pm_mesh.acc_y_im);
+    free(pm_mesh.pair_x);
+    free(pm_mesh.pair_y);
+    memset(&pm_mesh, 0, sizeof(pm_mesh));
+}
+
+/*
+ * Fraction of the force between two bodies at `distance' that is handled by
+ * the mesh when using P3M. It's the force of a mass spread as a Gaussian of
+ * scale `split', which is smooth enough for the mesh to represent it:
+ *
+ *   erf(r / 2s) - r / (s * sqrt(pi)) * exp(-r^2 / 4s^2)
+ *
+ * The rest falls quickly, and it's calculated directly up to PM_P3M_CUTOFF
+ * times `split', where it's below 2% of the force.
+ */
+static inline float pm_long_range(float distance, float split) {
+    const float u = distance / (2.f * split);
+    return erff(u) - 2.f * u / sqrtf((float)M_PI) * expf(-u * u);
+}
+
+/* Acceleration caused by a unit mass at an offset of (dx, dy) pixels from the
+ * target, as used in the mesh. See `pm_prepare'. */
+static inline void pm_kernel(double dx, double dy, float split, float softening,
+                             double* acc_x, double* acc_y) {
+    const double r2 = dx * dx + dy * dy;
+    if (r2 == 0.0) {
+        *acc_x = *acc_y = 0.0;
+        return;
+    }
+
+    const double soft = r2 + (double)softening * softening;
+    double inv        = 1.0 / (soft * sqrt(soft));
+    if (split > 0.f)
+        inv *= pm_long_range(sqrt(r2), split);
+    *acc_x = -dx * inv;
+    *acc_y = -dy * inv;
+}
+
+/*
+ * Make sure the mesh matches `pm_resolution' and the specified `split',
+ * rebuilding the kernel if needed. The kernel is the acceleration caused by a
+ * unit mass, (-dx, -dy) / r^3, as in `apply_acceleration'. With P3M, close
+ * pairs are calculated directly, so only the long-range part of the kernel is
+ * used, see `pm_long_range'. Otherwise, it's softened by one mesh spacing.
+ * The kernel is also kept for offsets up to `cutoff' pixels, see `pm_pair'.
+ */
+static void pm_prepare(float split, float cutoff) {
+    const float spacing = (float)GRID_W / (pm_resolution - 1);
+    const int pair_radius =
+      (split > 0.f) ? (int)ceilf(cutoff / spacing) + 1 : 0;
+    if (pm_mesh.nodes_x == pm_resolution && pm_mesh.split == split &&
+        pm_mesh.pair_radius >= pair_radius)
+        return;
+
+    pm_free();
+    pm_mesh.nodes_x = pm_resolution;
+    pm_mesh.nodes_y = (int)ceilf(GRID_H / spacing) + 1;
+    pm_mesh.w       = next_pow2(pm_mesh.nodes_x) * 2;
+    pm_mesh.h       = next_pow2(pm_mesh.nodes_y) * 2;
+    pm_mesh.spacing = spacing;
+    pm_mesh.split   = split;
+
+    const size_t size = (size_t)pm_mesh.w * pm_mesh.h;
+    double** arrays[] = {
+        &pm_mesh.kernel_x_re, &pm_mesh.kernel_x_im, &pm_mesh.kernel_y_re,
+        &pm_mesh.kernel_y_im, &pm_mesh.rho_re,      &pm_mesh.rho_im,
+        &pm_mesh.acc_x_re,    &pm_mesh.acc_x_im,    &pm_mesh.acc_y_re,
+        &pm_mesh.acc_y_im,
+    };
+    for (size_t i = 0; i < LENGTH(arrays); i++) {
+        *arrays[i] = calloc(size, sizeof(double));
+        if (*arrays[i] == NULL)
+            die("Unable to allocate PM mesh.");
+    }
+
+    const float softening = (split > 0.f) ? 0.f : spacing;
+    for (int y = 0; y < pm_mesh.h; y++) {
+        for (int x = 0; x < pm_mesh.w; x++) {
+            /* Negative offsets are stored at the end of each axis */
+            const double dx = ((x < pm_mesh.w / 2) ? x : x - pm_mesh.w) *
+                              (double)spacing;
+            const double dy = ((y < pm_mesh.h / 2) ? y : y - pm_mesh.h) *
+                              (double)spacing;
+
+            const size_t i = (size_t)y * pm_mesh.w + x;
+            pm_kernel(dx, dy, split, softening, &pm_mesh.kernel_x_re[i],
+                      &pm_mesh.kernel_y_re[i]);
+        }
+    }
+
+    pm_mesh.pair_radius = pair_radius;
+    if (pair_radius > 0) {
+        const int side = 2 * pair_radius + 1;
+        pm_mesh.pair_x = malloc((size_t)side * side * sizeof(float));
+        pm_mesh.pair_y = malloc((size_t)side * side * sizeof(float));
+        if (!pm_mesh.pair_x || !pm_mesh.pair_y)
+            die("Unable to allocate PM mesh.");
+
+        for (int y = 0; y < side; y++) {
+            for (int x = 0; x < side; x++) {
+                double acc_x, acc_y;
+                pm_kernel((x - pair_radius) * (double)spacing,
+                          (y - pair_radius) * (double)spacing, split, softening,
+                          &acc_x, &acc_y);
+                pm_mesh.pair_x[y * side + x] = (float)acc_x;
+                pm_mesh.pair_y[y * side + x] = (float)acc_y;
+            }
+        }
+    }
+
+    fft_2d(pm_mesh.kernel_x_re, pm_mesh.kernel_x_im, pm_mesh.w, pm_mesh.h,
+           false);
+    fft_2d(pm_mesh.kernel_y_re, pm_mesh.kernel_y_im, pm_mesh.w, pm_mesh.h,
+           false);
+}
+
+/* Whether the body is inside the nodes of the mesh */
+static inline bool pm_contains(const Body* body) {
+    return body->x >= 0.f && body->y >= 0.f &&
+           body->x < (pm_mesh.nodes_x - 1) * pm_mesh.spacing &&
+           body->y < (pm_mesh.nodes_y - 1) * pm_mesh.spacing;
+}
+
+/* Cloud-in-cell weights of a body. Returns the index of the top-left node. */
+static inline size_t pm_cic(const Body* body, float* fx, float* fy) {
+    const float u = body->x / pm_mesh.spacing;
+    const float v = body->y / pm_mesh.spacing;
+    const int x   = (int)u;
+    const int y   = (int)v;
+
+    *fx = u - x;
+    *fy = v - y;
+    return (size_t)y * pm_mesh.w + x;
+}
+
+/*
+ * Acceleration that the mesh gives to `a' because of `b'. The mass of `b' is
+ * spread to 4 nodes, convolved with the kernel, and interpolated from 4 nodes
+ * around `a', so this is the sum of the kernel between every pair of those
+ * nodes. Both bodies must be closer than `pair_radius' - 1 nodes.
+ */
+static void pm_pair(const Body* a, const Body* b, float* acc_x,
+                    float* acc_y) {
+    const float ua = a->x / pm_mesh.spacing, va = a->y / pm_mesh.spacing;
+    const float ub = b->x / pm_mesh.spacing, vb = b->y / pm_mesh.spacing;
+    const int xa = (int)ua, ya = (int)va;
+    const int xb = (int)ub, yb = (int)vb;
+
+    const float wa_x[2] = { 1.f - (ua - xa), ua - xa };
+    const float wa_y[2] = { 1.f - (va - ya), va - ya };
+    const float wb_x[2] = { 1.f - (ub - xb), ub - xb };
+    const float wb_y[2] = { 1.f - (vb - yb), vb - yb };
+
+    const int side = 2 * pm_mesh.pair_radius + 1;
+    *acc_x = *acc_y = 0.f;
+    for (int ia = 0; ia < 4; ia++) {
+        for (int ib = 0; ib < 4; ib++) {
+            const int ox = xa + (ia & 1) - xb - (ib & 1) + pm_mesh.pair_radius;
+            const int oy =
+              ya + (ia >> 1) - yb - (ib >> 1) + pm_mesh.pair_radius;
+            const float weight =
+              wa_x[ia & 1] * wa_y[ia >> 1] * wb_x[ib & 1] * wb_y[ib >> 1];
+
+            *acc_x += weight * pm_mesh.pair_x[oy * side + ox];
+            *acc_y += weight * pm_mesh.pair_y[oy * side + ox];
+        }
+    }
+
+    *acc_x *= b->mass;
+    *acc_y *= b->mass;
+}
+
+/*
+ * Calculate and apply gravity accelerations to all bodies with a particle-mesh
+ * solver. The mass is deposited on the mesh with cloud-in-cell, convolved with
+ * the kernel using FFTs, and the acceleration is interpolated back.
+ *
+ * With P3M enabled, the pairs closer than PM_P3M_CUTOFF times the split scale
+ * (or the collision distance, if bigger) are calculated with
+ * `apply_acceleration', so collisions keep working, and the force that the mesh
+ * gave them is removed with `pm_pair'. Without it, bodies never collide.
+ * Bodies outside of the mesh are always calculated directly.
+ */
+static void apply_pm(void) {
+    const float spacing = (float)GRID_W / (pm_resolution - 1);
+    const float split   = pm_p3m ? PM_P3M_SPLIT * spacing : 0.f;
+
+    /* Only bodies inside of the mesh can collide through the short-range
+     * pairs, the rest are calculated directly */
+    const float mesh_h = ceilf(GRID_H / spacing) * spacing;
+    float max_mass     = 0.f;
+    for (Body* body = bodies; body != NULL; body = body->next)
+        if (is_source(body) && body->x >= 0.f && body->y >= 0.f &&
+            body->x < GRID_W && body->y < mesh_h)
+            max_mass = fmaxf(max_mass, body->mass);
+
+    const float cutoff = fmaxf(PM_P3M_CUTOFF * split, 2.f * max_mass);
+    pm_prepare(split, cutoff);
+
+    const int w       = pm_mesh.w;
+    const size_t size = (size_t)w * pm_mesh.h;
+    memset(pm_mesh.rho_re, 0, size * sizeof(double));
+    memset(pm_mesh.rho_im, 0, size * sizeof(double));
+
+    /* Deposit the mass of the bodies inside the mesh */
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        if (!is_source(body) || !pm_contains(body))
+            continue;
+
+        float fx, fy;
+        const size_t i = pm_cic(body, &fx, &fy);
+        pm_mesh.rho_re[i] += body->mass * (1.f - fx) * (1.f - fy);
+        pm_mesh.rho_re[i + 1] += body->mass * fx * (1.f - fy);
+        pm_mesh.rho_re[i + w] += body->mass * (1.f - fx) * fy;
+        pm_mesh.rho_re[i + w + 1] += body->mass * fx * fy;
+    }
+
+    /* Convolve with the kernel */
+    fft_2d(pm_mesh.rho_re, pm_mesh.rho_im, w, pm_mesh.h, false);
+    for (size_t i = 0; i < size; i++) {
+        const double re = pm_mesh.rho_re[i], im = pm_mesh.rho_im[i];
+
+        pm_mesh.acc_x_re[i] =
+          re * pm_mesh.kernel_x_re[i] - im * pm_mesh.kernel_x_im[i];
+        pm_mesh.acc_x_im[i] =
+          re * pm_mesh.kernel_x_im[i] + im * pm_mesh.kernel_x_re[i];
+        pm_mesh.acc_y_re[i] =
+          re * pm_mesh.kernel_y_re[i] - im * pm_mesh.kernel_y_im[i];
+        pm_mesh.acc_y_im[i] =
+          re * pm_mesh.kernel_y_im[i] + im * pm_mesh.kernel_y_re[i];
+    }
+    fft_2d(pm_mesh.acc_x_re, pm_mesh.acc_x_im, w, pm_mesh.h, true);
+    fft_2d(pm_mesh.acc_y_re, pm_mesh.acc_y_im, w, pm_mesh.h, true);
+
+    /* Bodies outside of the mesh are handled directly, so keep a list */
+    size_t num_inside = 0, num_outside = 0;
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        if (!is_source(body))
+            continue;
+
+        if (pm_contains(body))
+            num_inside++;
+        else
+            num_outside++;
+    }
+
+    Body** inside  = malloc((num_inside + 1) * sizeof(Body*));
+    Body** outside = malloc((num_outside + 1) * sizeof(Body*));
+    if (!inside || !outside)
+        die("Unable to allocate PM mesh.");
+
+    num_inside = num_outside = 0;
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        if (!is_source(body))
+            continue;
+
+        if (pm_contains(body))
+            inside[num_inside++] = body;
+        else
+            outside[num_outside++] = body;
+    }
+
+    /* Chaining mesh for the short-range pairs, with cells of `cutoff' pixels.
+     * Each cell has the index of the first body in `inside', and `chain' links
+     * the rest. */
+    int chain_w = 0, chain_h = 0;
+    size_t* heads = NULL;
+    size_t* chain = NULL;
+    if (pm_p3m) {
+        chain_w = (int)ceilf((pm_mesh.nodes_x - 1) * spacing / cutoff);
+        chain_h = (int)ceilf((pm_mesh.nodes_y - 1) * spacing / cutoff);
+
+        heads = malloc((size_t)chain_w * chain_h * sizeof(size_t));
+        chain = malloc((num_inside + 1) * sizeof(size_t));
+        if (!heads || !chain)
+            die("Unable to allocate PM mesh.");
+
+        for (int i = 0; i < chain_w * chain_h; i++)
+            heads[i] = SIZE_MAX;
+
+        for (size_t i = 0; i < num_inside; i++) {
+            const int cx = (int)(inside[i]->x / cutoff);
+            const int cy = (int)(inside[i]->y / cutoff);
+            chain[i]     = heads[cy * chain_w + cx];
+            heads[cy * chain_w + cx] = i;
+        }
+    }
+
+    /* Outside of the mesh, use direct summation */
+    for (size_t i = 0; i < num_outside; i++) {
+        Body* a = outside[i];
+        if (a->type == BODY_STATIC)
+            continue;
+
+        for (size_t j = 0; j < num_inside; j++)
+            apply_acceleration(a, inside[j]);
+        for (size_t j = 0; j < num_outside; j++)
+            if (a != outside[j])
+                apply_acceleration(a, outside[j]);
+    }
+
+    for (size_t i = 0; i < num_inside; i++) {
+        Body* a = inside[i];
+
+        /* Static bodies don't move */
+        if (a->type == BODY_STATIC)
+            continue;
+
+        /* Short-range pairs, in the adjacent cells of the chaining mesh */
+        if (pm_p3m) {
+            const int cx = (int)(a->x / cutoff);
+            const int cy = (int)(a->y / cutoff);
+
+            for (int y = cy - 1; y <= cy + 1; y++) {
+                for (int x = cx - 1; x <= cx + 1; x++) {
+                    if (x < 0 || y < 0 || x >= chain_w || y >= chain_h)
+                        continue;
+
+                    for (size_t j = heads[y * chain_w + x]; j != SIZE_MAX;
+                         j        = chain[j]) {
+                        Body* b = inside[j];
+                        if (a == b)
+                            continue;
+
+                        const float dx       = b->x - a->x;
+                        const float dy       = b->y - a->y;
+                        const float distance = sqrtf(dx * dx + dy * dy);
+                        if (distance >= cutoff)
+                            continue;
+
+                        apply_acceleration(a, b);
+
+                        /* Remove the part that the mesh adds, unless they
+                         * collided and there was no attraction. */
+                        if (a->mass + b->mass >= distance)
+                            continue;
+
+                        float acc_x, acc_y;
+                        pm_pair(a, b, &acc_x, &acc_y);
+                        a->vel_x -= acc_x * sim_dt;
+                        a->vel_y -= acc_y * sim_dt;
+                    }
+                }
+            }
+        }
+
+        /* Sources outside of the mesh */
+        for (size_t j = 0; j < num_outside; j++)
+            apply_acceleration(a, outside[j]);
+
+        /* Interpolate the acceleration from the mesh */
+        float fx, fy;
+        const size_t node = pm_cic(a, &fx, &fy);
+        a->vel_x += (pm_mesh.acc_x_re[node] * (1.f - fx) * (1.f - fy) +
+                     pm_mesh.acc_x_re[node + 1] * fx * (1.f - fy) +
+                     pm_mesh.acc_x_re[node + w] * (1.f - fx) * fy +
+                     pm_mesh.acc_x_re[node + w + 1] * fx * fy) *
+                    sim_dt;
+        a->vel_y += (pm_mesh.acc_y_re[node] * (1.f - fx) * (1.f - fy) +
+                     pm_mesh.acc_y_re[node + 1] * fx * (1.f - fy) +
+                     pm_mesh.acc_y_re[node + w] * (1.f - fx) * fy +
+                     pm_mesh.acc_y_re[node + w + 1] * fx * fy) *
+                    sim_dt;
+    }
+
+    free(heads);
+    free(chain);
+    free(outside);
+    free(inside);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Static field cache */
+
+/*
+ * Static bodies never move, so their combined acceleration is calculated once
+ * on a grid covering the window, and interpolated every step. Bodies close
+ * enough to a static body (see `static_near_distance') are still calculated
+ * with `apply_acceleration', so collisions work and the interpolation doesn't
+ * need to follow the field near the center of the static body.
+ *
+ * To make that exact, each cell stores its own 4 corners, without the
+ * statics that are near that cell. The cache is rebuilt when the statics
+ * change, see `static_cache_dirty'.
+ */
+typedef struct StaticCache {
+    /* Static bodies, in list order */
+    Body** statics;
+    size_t num_statics;
+
+    /* Acceleration at the corners of each cell, in the order top-left,
+     * top-right, bottom-left, bottom-right */
+    float* corners_x;
+    float* corners_y;
+
+    /* Indexes in `statics' of the near statics of each cell */
+    size_t* near_start;
+    size_t* near;
+} StaticCache;
+
+static StaticCache static_cache_data;
+
+static void static_cache_free(void) {
+    free(static_cache_data.statics);
+    free(static_cache_data.corners_x);
+    free(static_cache_data.corners_y);
+    free(static_cache_data.near_start);
+    free(static_cache_data.near);
+    memset(&static_cache_data, 0, sizeof(static_cache_data));
+}
+
+/* Distance from a static body at which a dynamic body is calculated directly,
+ * for a cache built with the specified reach */
+static inline float static_near_distance(const Body* body, float reach) {
+    return body->mass + reach + STATIC_CACHE_MARGIN * STATIC_CACHE_CELL;
+}
+
+/* Range of cells overlapped by the near distance of a static body. Returns
+ * false if it's outside of the grid. */
+static bool static_near_cells(const Body* body, float reach, int* min_x,
+                              int* min_y, int* max_x, int* max_y) {
+    const float distance = static_near_distance(body, reach);
+
+    *min_x = (int)floorf((body->x - distance) / STATIC_CACHE_CELL);
+    *min_y = (int)floorf((body->y - distance) / STATIC_CACHE_CELL);
+    *max_x = (int)floorf((body->x + distance) / STATIC_CACHE_CELL);
+    *max_y = (int)floorf((body->y + distance) / STATIC_CACHE_CELL);
+
+    if (*max_x < 0 || *max_y < 0 || *min_x >= STATIC_CACHE_W ||
+        *min_y >= STATIC_CACHE_H)
+        return false;
+
+    *min_x = (*min_x < 0) ? 0 : *min_x;
+    *min_y = (*min_y < 0) ? 0 : *min_y;
+    *max_x = (*max_x >= STATIC_CACHE_W) ? STATIC_CACHE_W - 1 : *max_x;
+    *max_y = (*max_y >= STATIC_CACHE_H) ? STATIC_CACHE_H - 1 : *max_y;
+    return true;
+}
+
+/* Acceleration caused by a static body at the specified point, as in
+ * `attract' */
+static inline void static_field_at(const Body* body, double x, double y,
+                                   double* acc_x, double* acc_y) {
+    const double dx = body->x - x;
+    const double dy = body->y - y;
+    const double r2 = dx * dx + dy * dy;
+    if (r2 == 0.0)
+        return;
+
+    const double acc = body->mass / r2;
+    const double r   = sqrt(r2);
+    *acc_x += acc * dx / r;
+    *acc_y += acc * dy / r;
+}
+
+static void static_cache_build(void) {
+    static_cache_free();
+    StaticCache* cache = &static_cache_data;
+
+    /* Separate the static bodies, and get the biggest dynamic mass inside of
+     * the grid, since the rest are calculated directly */
+    static_cache_reach = 0.f;
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        if (body->type == BODY_STATIC)
+            cache->num_statics++;
+        else if (body->mass > static_cache_reach && body->x >= 0.f &&
+                 body->y >= 0.f && body->x < GRID_W && body->y < GRID_H)
+            static_cache_reach = body->mass;
+    }
+
+    /* Leave some room, so adding slightly bigger bodies doesn't rebuild */
+    static_cache_reach = fmaxf(static_cache_reach, current_mass) * 2.f;
+
+    const size_t cells = STATIC_CACHE_W * STATIC_CACHE_H;
+    cache->statics     = malloc((cache->num_statics + 1) * sizeof(Body*));
+    cache->corners_x   = calloc(cells * 4, sizeof(float));
+    cache->corners_y   = calloc(cells * 4, sizeof(float));
+    cache->near_start  = calloc(cells + 1, sizeof(size_t));
+    if (!cache->statics || !cache->corners_x || !cache->corners_y ||
+        !cache->near_start)
+        die("Unable to allocate static field cache.");
+
+    size_t i = 0;
+    for (Body* body = bodies; body != NULL; body = body->next)
+        if (body->type == BODY_STATIC)
+            cache->statics[i++] = body;
+
+    /* Near statics of each cell, with a counting sort */
+    int min_x, min_y, max_x, max_y;
+    for (size_t s = 0; s < cache->num_statics; s++) {
+        if (!static_near_cells(cache->statics[s], static_cache_reach, &min_x,
+                               &min_y, &max_x, &max_y))
+            continue;
+
+        for (int y = min_y; y <= max_y; y++)
+            for (int x = min_x; x <= max_x; x++)
+                cache->near_start[y * STATIC_CACHE_W + x + 1]++;
+    }
+    for (size_t cell = 0; cell < cells; cell++)
+        cache->near_start[cell + 1] += cache->near_start[cell];
+
+    cache->near = malloc((cache->near_start[cells] + 1) * sizeof(size_t));
+    size_t* fill = malloc(cells * sizeof(size_t));
+    if (!cache->near || !fill)
+        die("Unable to allocate static field cache.");
+    memcpy(fill, cache->near_start, cells * sizeof(size_t));
+
+    for (size_t s = 0; s < cache->num_statics; s++) {
+        if (!static_near_cells(cache->statics[s], static_cache_reach, &min_x,
+                               &min_y, &max_x, &max_y))
+            continue;
+
+        for (int y = min_y; y <= max_y; y++)
+            for (int x = min_x; x <= max_x; x++)
+                cache->near[fill[y * STATIC_CACHE_W + x]++] = s;
+    }
+    free(fill);
+
+    /* Total field at each node, shared by the 4 cells around it */
+    const int nodes_w = STATIC_CACHE_W + 1;
+    const int nodes_h = STATIC_CACHE_H + 1;
+    double* nodes_x   = calloc((size_t)nodes_w * nodes_h, sizeof(double));
+    double* nodes_y   = calloc((size_t)nodes_w * nodes_h, sizeof(double));
+    if (!nodes_x || !nodes_y)
+        die("Unable to allocate static field cache.");
+
+    for (int y = 0; y < nodes_h; y++)
+        for (int x = 0; x < nodes_w; x++)
+            for (size_t s = 0; s < cache->num_statics; s++)
+                static_field_at(cache->statics[s], x * STATIC_CACHE_CELL,
+                                y * STATIC_CACHE_CELL,
+                                &nodes_x[y * nodes_w + x],
+                                &nodes_y[y * nodes_w + x]);
+
+    /* The corners of each cell are the total field, without the near
+     * statics of that cell */
+    for (int y = 0; y < STATIC_CACHE_H; y++) {
+        for (int x = 0; x < STATIC_CACHE_W; x++) {
+            const size_t cell = y * STATIC_CACHE_W + x;
+
+            for (int corner = 0; corner < 4; corner++) {
+                const int node_x = x + (corner & 1);
+                const int node_y = y + (corner >> 1);
+
+                double acc_x = nodes_x[node_y * nodes_w + node_x];
+                double acc_y = nodes_y[node_y * nodes_w + node_x];
+
+                double near_x = 0.0, near_y = 0.0;
+                for (size_t n = cache->near_start[cell];
+                     n < cache->near_start[cell + 1]; n++)
+                    static_field_at(cache->statics[cache->near[n]],
+                                    node_x * STATIC_CACHE_CELL,
+                                    node_y * STATIC_CACHE_CELL, &near_x,
+                                    &near_y);
+
+                cache->corners_x[cell * 4 + corner] = acc_x - near_x;
+                cache->corners_y[cell * 4 + corner] = acc_y - near_y;
+            }
+        }
+    }
+
+    free(nodes_x);
+    free(nodes_y);
+    static_cache_dirty = false;
+}
+
+/* Calculate and apply the gravity accelerations of the static bodies to the
+ * dynamic ones, using the cache. Bodies outside of the window, or too big for
+ * the near statics of the cache, are calculated directly. */
+static void apply_static_field(void) {
+    if (static_cache_dirty)
+        static_cache_build();
+
+    const StaticCache* cache = &static_cache_data;
+    if (cache->num_statics == 0)
+        return;
+
+    for (Body* a = bodies; a != NULL; a = a->next) {
+        /* Static bodies don't move */
+        if (a->type == BODY_STATIC)
+            continue;
+
+        const float u = a->x / STATIC_CACHE_CELL;
+        const float v = a->y / STATIC_CACHE_CELL;
+        if (u < 0.f || v < 0.f || u >= STATIC_CACHE_W || v >= STATIC_CACHE_H ||
+            a->mass > static_cache_reach) {
+            for (size_t s = 0; s < cache->num_statics; s++)
+                apply_acceleration(a, cache->statics[s]);
+            continue;
+        }
+
+        const int x       = (int)u;
+        const int y       = (int)v;
+        const float fx    = u - x;
+        const float fy    = v - y;
+        const size_t cell = y * STATIC_CACHE_W + x;
+
+        for (size_t n = cache->near_start[cell];
+             n < cache->near_start[cell + 1]; n++)
+            apply_acceleration(a, cache->statics[cache->near[n]]);
+
+        /* Bilinear interpolation of the corners */
+        const float* cx = &cache->corners_x[cell * 4];
+        const float* cy = &cache->corners_y[cell * 4];
+        a->vel_x += ((cx[0] * (1.f - fx) + cx[1] * fx) * (1.f - fy) +
+                     (cx[2] * (1.f - fx) + cx[3] * fx) * fy) *
+                    sim_dt;
+        a->vel_y += ((cy[0] * (1.f - fx) + cy[1] * fx) * (1.f - fy) +
+                     (cy[2] * (1.f - fx) + cy[3] * fx) * fy) *
+                    sim_dt;
+    }
+}
+
+/* Calculate and apply gravity accelerations with the current solver */
+static void apply_gravity(void) {
+    switch (gravity_solver) {
+        case GRAVITY_FMM:
+            apply_fmm();
+            break;
+        case GRAVITY_PM:
+            apply_pm();
+            break;
+        case GRAVITY_DIRECT:
+        default:
+            apply_accelerations();
+            break;
+    }
+
+    if (static_cache)
+        apply_static_field();
+}
+
+static void move_bodies(void) {
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        /* Static bodies don't move */
+        if (body->type == BODY_STATIC)
+            continue;
+
+        body->x += body->vel_x * sim_dt;
+        body->y += body->vel_y * sim_dt;
+    }
+}
+
+/* Apply the current bounds policy to the dynamic bodies outside of the
+ * window. Note that the window is not periodic for the gravity solvers, so
+ * with BOUNDS_WRAP bodies are not attracted across the edges. */
+static void apply_bounds(void) {
+    if (bounds_policy == BOUNDS_OPEN)
+        return;
+
+    Body* prev = NULL;
+    Body* body = bodies;
+    while (body != NULL) {
+        Body* next = body->next;
+
+        /* Static bodies don't move */
+        if (body->type == BODY_STATIC) {
+            prev = body;
+            body = next;
+            continue;
+        }
+
+        switch (bounds_policy) {
+            case BOUNDS_WRAP:
+                body->x -= GRID_W * floorf(body->x / GRID_W);
+                body->y -= GRID_H * floorf(body->y / GRID_H);
+                break;
+            case BOUNDS_REFLECT:
+                if (body->x < 0.f) {
+                    body->x     = fminf(-body->x, GRID_W);
+                    body->vel_x = -body->vel_x;
+                } else if (body->x > GRID_W) {
+                    body->x     = fmaxf(2.f * GRID_W - body->x, 0.f);
+                    body->vel_x = -body->vel_x;
+                }
+
+                if (body->y < 0.f) {
+                    body->y     = fminf(-body->y, GRID_H);
+                    body->vel_y = -body->vel_y;
+                } else if (body->y > GRID_H) {
+                    body->y     = fmaxf(2.f * GRID_H - body->y, 0.f);
+                    body->vel_y = -body->vel_y;
+                }
+                break;
+            case BOUNDS_RETIRE:
+                if (body->x < -RETIRE_MARGIN || body->y < -RETIRE_MARGIN ||
+                    body->x > GRID_W + RETIRE_MARGIN ||
+                    body->y > GRID_H + RETIRE_MARGIN) {
+                    /* The previous body stays the same */
+                    retire_body(prev, body);
+                    body = next;
+                    continue;
+                }
+                break;
+            case BOUNDS_OPEN:
+            default:
+                break;
+        }
+
+        prev = body;
+        body = next;
+    }
+}
+
+/* Advance the simulation by one step, divided in `sim_substeps' substeps */
+static void step_simulation(void) {
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        body->prev_x = body->x;
+        body->prev_y = body->y;
+    }
+
+    sim_dt = 1.f / sim_substeps;
+    for (int i = 0; i < sim_substeps; i++) {
+        /* Calculate and apply the gravity accelerations to each body */
+        apply_gravity();
+
+        /* Apply the velocity of each body */
+        move_bodies();
+
+        /* Wrap, reflect or retire the bodies outside of the window */
+        apply_bounds();
+    }
+
+    sim_step++;
+}
+
+/*
+ * Render the bodies visible with the current camera. Bodies smaller than a
+ * pixel are not drawn as circles. Instead, they are accumulated per pixel, and
+ * drawn as a single point with their color, or with the heatmap color if there
+ * are more bodies in the same pixel. This way, the drawing cost depends on the
+ * visible pixels, not on the number of bodies.
+ *
+ * The bodies are drawn between their previous and current positions, at
+ * `alpha' (from 0 to 1) of the last step, so the motion is smooth even when
+ * the number of steps per frame changes.
+ */
+static void render_grid(SDL_Renderer* rend, float alpha) {
+    /* Bodies per pixel, and the type of the last one. The list of touched
+     * pixels is used for drawing and clearing them without scanning the whole
+     * window. */
+    static uint32_t pixel_count[GRID_W * GRID_H];
+    static uint8_t pixel_type[GRID_W * GRID_H];
+    static uint32_t touched[GRID_W * GRID_H];
+    size_t num_touched = 0;
+
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        assert(body->type < LENGTH(color_palette));
+
+        /* Interpolate the position, unless the body wrapped around the window
+         * in the last step */
+        float world_x = body->x;
+        float world_y = body->y;
+        if (fabsf(body->x - body->prev_x) < GRID_W / 2.f &&
+            fabsf(body->y - body->prev_y) < GRID_H / 2.f) {
+            world_x = body->prev_x + (body->x - body->prev_x) * alpha;
+            world_y = body->prev_y + (body->y - body->prev_y) * alpha;
+        }
+
+        /* Transform to screen coordinates */
+        const float screen_x = (world_x - camera.x) * camera.zoom;
+        const float screen_y = (world_y - camera.y) * camera.zoom;
+        const float screen_r = body->mass * camera.zoom;
+
+        /* Skip the bodies outside of the window */
+        if (screen_x + screen_r < 0.f || screen_y + screen_r < 0.f ||
+            screen_x - screen_r >= GRID_W || screen_y - screen_r >= GRID_H)
+            continue;
+
+        /* Round float positions to get the grid coordinates */
+        const int x = (int)roundf(screen_x);
+        const int y = (int)roundf(screen_y);
+
+        /* Round mass to get the circle radius */
+        const int radius = (int)roundf(screen_r);
+
+        if (radius < 1) {
+            if (x < 0 || y < 0 || x >= GRID_W || y >= GRID_H)
+                continue;
+
+            const uint32_t pixel = y * GRID_W + x;
+            if (pixel_count[pixel]++ == 0)
+                touched[num_touched++] = pixel;
+            pixel_type[pixel] = body->type;
+            continue;
+        }
+
+        const uint32_t color = color_palette[body->type];
+
+        if (body->type == BODY_STATIC)
+            draw_circle(rend, x, y, radius, color);
+        else
+            draw_circle_filled(rend, x, y, radius, color);
+    }
+
+    if (num_touched == 0)
+        return;
+
+    /* Group the accumulated pixels by color, so each color is drawn at once.
+     * The first groups are the body types, and the rest the heatmap levels. */
+    enum { NUM_GROUPS = LENGTH(color_palette) + HEATMAP_LEVELS };
+    static SDL_Point points[GRID_W * GRID_H];
+    size_t group_start[NUM_GROUPS + 1] = { 0 };
+
+    for (size_t i = 0; i < num_touched; i++) {
+        const uint32_t pixel = touched[i];
+        const uint32_t count = pixel_count[pixel];
+
+        int group = pixel_type[pixel];
+        if (count > 1) {
+            int level = 0;
+            while (level < HEATMAP_LEVELS - 1 && (count >> (level + 2)) != 0)
+                level++;
+            group = LENGTH(color_palette) + level;
+        }
+
+        /* From now on, the type of the pixel is not needed, store the group */
+        pixel_type[pixel] = group;
+        group_start[group + 1]++;
+    }
+    for (int i = 0; i < NUM_GROUPS; i++)
+        group_start[i + 1] += group_start[i];
+
+    size_t fill[NUM_GROUPS];
+    memcpy(fill, group_start, sizeof(fill));
+    for (size_t i = 0; i < num_touched; i++) {
+        const uint32_t pixel = touched[i];
+        SDL_Point* point     = &points[fill[pixel_type[pixel]]++];
+        point->x             = pixel % GRID_W;
+        point->y             = pixel / GRID_W;
+
+        pixel_count[pixel] = 0;
+    }
+
+    for (int i = 0; i < NUM_GROUPS; i++) {
+        const int num_points = group_start[i + 1] - group_start[i];
+        if (num_points == 0)
+            continue;
+
+        set_render_color(rend, (i < (int)LENGTH(color_palette))
+                                 ? color_palette[i]
+                                 : heatmap_palette[i - LENGTH(color_palette)]);
+        SDL_RenderDrawPoints(rend, &points[group_start[i]], num_points);
+    }
+}
+
+static void free_bodies(void) {
+    Body* body = bodies;
+    while (body != NULL) {
+        Body* aux = body->next;
+        free(body);
+        body = aux;
+    }
+    bodies    = NULL;
+    last_body = NULL;
+
+    static_cache_dirty = true;
+}
+
+/* Free the bodies kept for reuse by `add_body' */
+static void free_retired_bodies(void) {
+    Body* body = free_list;
+    while (body != NULL) {
+        Body* aux = body->next;
+        free(body);
+        body = aux;
+    }
+    free_list = NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Benchmarks */
+
+static double get_seconds(void) {
+    return (double)SDL_GetPerformanceCounter() /
+           (double)SDL_GetPerformanceFrequency();
+}
+
+/* Simple LCG, so the generated scenes are the same on every platform */
+static float random_float(uint32_t* state) {
+    *state = *state * 1664525u + 1013904223u;
+    return (float)(*state >> 8) / (float)(1u << 24);
+}
+
+/* Add `num' bodies with the current mass, on a jittered lattice covering the
+ * window. As long as the mass is small compared to the spacing, no two bodies
+ * collide, so the results don't depend on the order of the accelerations.
+ * Every tenth body is static. */
+static void add_random_bodies(size_t num, uint32_t seed) {
+    const size_t cols = (size_t)ceilf(sqrtf((float)num * GRID_W / GRID_H));
+    const size_t rows = (num + cols - 1) / cols;
+    const float cell_w = (float)GRID_W / cols;
+    const float cell_h = (float)GRID_H / rows;
+
+    for (size_t i = 0; i < num; i++) {
+        const float fx = 0.1f + random_float(&seed) * 0.8f;
+        const float fy = 0.1f + random_float(&seed) * 0.8f;
+        add_body((i % cols + fx) * cell_w, (i / cols + fy) * cell_h,
+                 (i % 10 == 0) ? BODY_STATIC : BODY_DYNAMIC);
+    }
+}
+
+/* Targets compared against direct summation, see `bench_solvers' */
+static size_t bench_num_sample = 0;
+static Body* bench_sample[BENCH_SAMPLE];
+static float bench_ref_x[BENCH_SAMPLE], bench_ref_y[BENCH_SAMPLE];
+static double bench_direct_time;
+
+/* Run `solver' from a scene without velocities, and print a row with its time
+ * and its relative errors compared to the direct sum. The static field cache
+ * is included, if enabled. */
+static void bench_row(const char* name, int param, void (*solver)(void)) {
+    for (Body* body = bodies; body != NULL; body = body->next)
+        body->vel_x = body->vel_y = 0.f;
+
+    const double start = get_seconds();
+    solver();
+    if (static_cache)
+        apply_static_field();
+    const double time = get_seconds() - start;
+
+    double sum_sq = 0.0, max_err = 0.0;
+    for (size_t s = 0; s < bench_num_sample; s++) {
+        const double ex  = bench_sample[s]->vel_x - bench_ref_x[s];
+        const double ey  = bench_sample[s]->vel_y - bench_ref_y[s];
+        const double ref = hypot(bench_ref_x[s], bench_ref_y[s]);
+        const double err = (ref > 0.0) ? hypot(ex, ey) / ref : 0.0;
+
+        sum_sq += err * err;
+        if (err > max_err)
+            max_err = err;
+    }
+
+    printf("%-8s %5d %12.4f %9.2f %12.3e %12.3e\n", name, param, time,
+           bench_direct_time / time, sqrt(sum_sq / bench_num_sample), max_err);
+}
+
+/* Solver for `bench_static_cache', so only the static field is applied */
+static void bench_no_solver(void) {}
+
+/* Compare the static field cache against the direct sum of the static bodies
+ * on the sampled targets. The references of `bench_scene' are replaced. */
+static void bench_static_cache(void) {
+    size_t num_dynamic = 0, num_statics = 0;
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        if (body->type == BODY_STATIC)
+            num_statics++;
+        else
+            num_dynamic++;
+    }
+    if (num_statics == 0)
+        return;
+
+    for (Body* body = bodies; body != NULL; body = body->next)
+        body->vel_x = body->vel_y = 0.f;
+
+    const double start = get_seconds();
+    for (size_t s = 0; s < bench_num_sample; s++) {
+        Body* a = bench_sample[s];
+        for (Body* b = bodies; b != NULL; b = b->next)
+            if (b->type == BODY_STATIC)
+                apply_acceleration(a, b);
+
+        bench_ref_x[s] = a->vel_x;
+        bench_ref_y[s] = a->vel_y;
+    }
+    bench_direct_time =
+      (get_seconds() - start) * (double)num_dynamic / bench_num_sample;
+
+    /* The cache is built once, so it's not included in the time */
+    const bool old_cache = static_cache;
+    static_cache         = true;
+    static_cache_build();
+    bench_row("cache", STATIC_CACHE_CELL, bench_no_solver);
+
+    static_cache       = old_cache;
+    static_cache_dirty = true;
+}
+
+/*
+ * Compare the approximate solvers against direct summation on the current
+ * scene, and print a table with the results. The FMM solver is run with orders
+ * from 1 to `fmm_order', and the PM solver with every resolution up to
+ * `pm_resolution', with and without P3M, unless P3M would be as slow as the
+ * direct sum (see BENCH_P3M_NEIGHBOURS). The last row compares the static field
+ * cache against the direct sum of the static bodies only. Since the direct sum
+ * is too slow for big scenes, it's only calculated for a sample of the targets,
+ * and its total time is estimated from it.
+ */
+static void bench_scene(const char* title) {
+    /* Pick a sample of dynamic bodies, evenly spaced in the list. Bodies far
+     * from the window are few, so all of them are included. */
+    size_t num = 0, num_dynamic = 0, num_far = 0;
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        num++;
+        if (body->type == BODY_DYNAMIC) {
+            num_dynamic++;
+            if (is_far(body))
+                num_far++;
+        }
+    }
+
+    const size_t stride =
+      num_dynamic / (BENCH_SAMPLE - BENCH_OUTLIERS - 1) + 1;
+    size_t i            = 0;
+    bench_num_sample    = 0;
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        if (body->type != BODY_DYNAMIC)
+            continue;
+        const bool outlier = is_far(body) && num_far <= BENCH_OUTLIERS + 1;
+        if ((i++ % stride == 0 || outlier) && bench_num_sample < BENCH_SAMPLE)
+            bench_sample[bench_num_sample++] = body;
+    }
+
+    /* Reference accelerations. Since all bodies start without velocity, the
+     * velocity after a step is the acceleration. */
+    for (Body* body = bodies; body != NULL; body = body->next)
+        body->vel_x = body->vel_y = 0.f;
+
+    const double start = get_seconds();
+    for (size_t s = 0; s < bench_num_sample; s++) {
+        Body* a = bench_sample[s];
+        for (Body* b = bodies; b != NULL; b = b->next)
+            if (a != b)
+                apply_acceleration(a, b);
+
+        bench_ref_x[s] = a->vel_x;
+        bench_ref_y[s] = a->vel_y;
+    }
+    bench_direct_time =
+      (get_seconds() - start) * (double)num_dynamic / bench_num_sample;
+
+    printf("%s: %zu bodies (%zu dynamic, %zu far), sampled targets: %zu\n",
+           title, num, num_dynamic, num_far, bench_num_sample);
+    printf("%-8s %5s %12s %9s %12s %12s\n", "solver", "param", "time (s)",
+           "speedup", "rms error", "max error");
+    printf("%-8s %5s %12.4f %9.2f %12.3e %12.3e  (estimated)\n", "direct", "-",
+           bench_direct_time, 1.0, 0.0, 0.0);
+
+    const int max_order = fmm_order;
+    for (fmm_order = 1; fmm_order <= max_order; fmm_order++)
+        bench_row("fmm", fmm_order, apply_fmm);
+    fmm_order = max_order;
+
+    const int max_resolution = pm_resolution;
+    const bool old_p3m       = pm_p3m;
+    for (pm_p3m = false;; pm_p3m = true) {
+        for (pm_resolution = PM_MIN_RESOLUTION; pm_resolution <= max_resolution;
+             pm_resolution *= 2) {
+            /* Bodies within the cutoff, assuming they fill the window */
+            const float spacing = (float)GRID_W / (pm_resolution - 1);
+            const float cutoff  = PM_P3M_CUTOFF * PM_P3M_SPLIT * spacing;
+            const double neighbours =
+              (double)num * M_PI * cutoff * cutoff / (GRID_W * GRID_H);
+
+            if (pm_p3m && neighbours > BENCH_P3M_NEIGHBOURS) {
+                printf("%-8s %5d  (skipped, %.0f bodies within the cutoff)\n",
+                       "p3m", pm_resolution, neighbours);
+                continue;
+            }
+
+            bench_row(pm_p3m ? "p3m" : "pm", pm_resolution, apply_pm);
+        }
+
+        if (pm_p3m)
+            break;
+    }
+    pm_resolution = max_resolution;
+    pm_p3m        = old_p3m;
+
+    bench_static_cache();
+    bench_num_sample = 0;
+}
+
+/*
+ * Run `bench_scene' on a jittered lattice of `num' bodies covering the window,
+ * and then on the same scene with BENCH_OUTLIERS bodies that escaped: half of
+ * them very far away, and half of them just outside of the region near the
+ * window. A heavy body is also added to the left of the window, far enough to
+ * be outside of the FMM tree. The solvers should be as fast and accurate in
+ * both.
+ */
+static void bench_solvers(size_t num) {
+    const float old_mass = current_mass;
+    current_mass         = 0.05f;
+
+    add_random_bodies(num, 1337);
+    bench_scene("Lattice");
+    putchar('\n');
+
+    for (int i = 0; i < BENCH_OUTLIERS; i++) {
+        const float angle    = 2.f * (float)M_PI * i / BENCH_OUTLIERS;
+        const float distance = (i % 2 == 0)
+                                 ? BENCH_OUTLIER_DISTANCE
+                                 : 1.5f * (GRID_W / 2.f + FAR_FIELD_MARGIN);
+        add_body(GRID_W / 2.f + distance * cosf(angle),
+                 GRID_H / 2.f + distance * sinf(angle), BODY_DYNAMIC);
+    }
+
+    current_mass = BENCH_HEAVY_MASS;
+    add_body(-GRID_W / 2.f - FAR_FIELD_MARGIN, GRID_H / 2.f, BODY_DYNAMIC);
+    current_mass = 0.05f;
+    bench_scene("Lattice with outliers");
+
+    current_mass = old_mass;
+    free_bodies();
+    free_retired_bodies();
+}
+
+/*----------------------------------------------------------------------------*/
+/* Actions */
+
+/* Make sure the global variables are within bounds */
+static void clamp_settings(void) {
+    if (current_mass < 1.f)
+        current_mass = 1.f;
+    if (current_bounce < 0.f)
+        current_bounce = 0.f;
+    if (fmm_order < 1)
+        fmm_order = 1;
+    if (fmm_order > FMM_MAX_ORDER)
+        fmm_order = FMM_MAX_ORDER;
+    if (pm_resolution < PM_MIN_RESOLUTION)
+        pm_resolution = PM_MIN_RESOLUTION;
+    if (pm_resolution > PM_MAX_RESOLUTION)
+        pm_resolution = PM_MAX_RESOLUTION;
+    if (sim_substeps < 1)
+        sim_substeps = 1;
+    if (sim_substeps > FRAME_MAX_SUBSTEPS)
+        sim_substeps = FRAME_MAX_SUBSTEPS;
+}
+
+/* Apply an action to the simulation. Returns false if the action was
+ * ACTION_QUIT. */
+static bool apply_action(const Action* action) {
+    switch (action->type) {
+        case ACTION_QUIT:
+            return false;
+        case ACTION_ADD_DYNAMIC:
+            add_body(action->x, action->y, BODY_DYNAMIC);
+            break;
+        case ACTION_ADD_STATIC:
+            add_body(action->x, action->y, BODY_STATIC);
+            break;
+        case ACTION_CLEAR:
+            free_bodies();
+            break;
+        case ACTION_MASS_DOWN:
+            current_mass -= CURRENT_MASS_STEP;
+            break;
+        case ACTION_MASS_UP:
+            current_mass += CURRENT_MASS_STEP;
+            break;
+        case ACTION_BOUNCE_DOWN:
+            current_bounce -= CURRENT_BOUNCE_STEP;
+            break;
+        case ACTION_BOUNCE_UP:
+            current_bounce += CURRENT_BOUNCE_STEP;
+            break;
+        case ACTION_FMM_ORDER_DOWN:
+            fmm_order--;
+            break;
+        case ACTION_FMM_ORDER_UP:
+            fmm_order++;
+            break;
+        case ACTION_PM_RESOLUTION_DOWN:
+            pm_resolution /= 2;
+            break;
+        case ACTION_PM_RESOLUTION_UP:
+            pm_resolution *= 2;
+            break;
+        case ACTION_TOGGLE_P3M:
+            pm_p3m = !pm_p3m;
+            break;
+        case ACTION_CYCLE_SOLVER:
+            gravity_solver = (gravity_solver + 1) % GRAVITY_SOLVER_COUNT;
+            break;
+        case ACTION_CYCLE_BOUNDS:
+            bounds_policy = (bounds_policy + 1) % BOUNDS_POLICY_COUNT;
+            break;
+        case ACTION_TOGGLE_STATIC_CACHE:
+            static_cache       = !static_cache;
+            static_cache_dirty = true;
+            break;
+        case ACTION_SET_SUBSTEPS:
+            sim_substeps = action->value;
+            break;
+        default:
+            die("Unknown action type: %u", action->type);
+    }
+
+    clamp_settings();
+    return true;
+}
+
+/* Convert an SDL event to an action. Returns false if the event is ignored. */
+static bool event_to_action(const SDL_Event* sdl_event, Action* action) {
+    memset(action, 0, sizeof(Action));
+    action->step = sim_step;
+
+    switch (sdl_event->type) {
+        case SDL_QUIT:
+            action->type = ACTION_QUIT;
+            return true;
+        case SDL_KEYDOWN:
+            switch (sdl_event->key.keysym.scancode) {
+                case SDL_SCANCODE_ESCAPE:
+                case SDL_SCANCODE_Q:
+                    action->type = ACTION_QUIT;
+                    return true;
+                case SDL_SCANCODE_C:
+                    action->type = ACTION_CLEAR;
+                    return true;
+                case SDL_SCANCODE_1:
+                    action->type = ACTION_MASS_DOWN;
+                    return true;
+                case SDL_SCANCODE_2:
+                    action->type = ACTION_MASS_UP;
+                    return true;
+                case SDL_SCANCODE_3:
+                    action->type = ACTION_BOUNCE_DOWN;
+                    return true;
+                case SDL_SCANCODE_4:
+                    action->type = ACTION_BOUNCE_UP;
+                    return true;
+                case SDL_SCANCODE_5:
+                    action->type = ACTION_FMM_ORDER_DOWN;
+                    return true;
+                case SDL_SCANCODE_6:
+                    action->type = ACTION_FMM_ORDER_UP;
+                    return true;
+                case SDL_SCANCODE_7:
+                    action->type = ACTION_PM_RESOLUTION_DOWN;
+                    return true;
+                case SDL_SCANCODE_8:
+                    action->type = ACTION_PM_RESOLUTION_UP;
+                    return true;
+                case SDL_SCANCODE_P:
+                    action->type = ACTION_TOGGLE_P3M;
+                    return true;
+                case SDL_SCANCODE_G:
+                    action->type = ACTION_CYCLE_SOLVER;
+                    return true;
+                case SDL_SCANCODE_B:
+                    action->type = ACTION_CYCLE_BOUNDS;
+                    return true;
+                case SDL_SCANCODE_S:
+                    action->type = ACTION_TOGGLE_STATIC_CACHE;
+                    return true;
+                default:
+                    return false;
+            } /* End scancode switch */
+        case SDL_MOUSEBUTTONUP:
+            /* The journal stores world coordinates, independent of the
+             * camera */
+            action->x = camera.x + sdl_event->button.x / camera.zoom;
+            action->y = camera.y + sdl_event->button.y / camera.zoom;
+
+            switch (sdl_event->button.button) {
+                case SDL_BUTTON_LEFT:
+                    action->type = ACTION_ADD_DYNAMIC;
+                    return true;
+                case SDL_BUTTON_RIGHT:
+                    action->type = ACTION_ADD_STATIC;
+                    return true;
+                default:
+                    return false;
+            } /* End mouse button switch */
+        case SDL_MOUSEWHEEL:
+            /* Increase or decrease current mass with mouse wheel */
+            action->type =
+              (sdl_event->wheel.y > 0) ? ACTION_MASS_UP : ACTION_MASS_DOWN;
+            return true;
+        default:
+            return false;
+    } /* End event.type switch */
+}
+
+/*----------------------------------------------------------------------------*/
+/* Camera */
+
+/* Multiply the zoom by `factor', keeping the world position under the screen
+ * position (x, y) in place. */
+static void camera_zoom(float factor, int x, int y) {
+    float zoom = camera.zoom * factor;
+    if (zoom < CAMERA_MIN_ZOOM)
+        zoom = CAMERA_MIN_ZOOM;
+    if (zoom > CAMERA_MAX_ZOOM)
+        zoom = CAMERA_MAX_ZOOM;
+
+    camera.x += x / camera.zoom - x / zoom;
+    camera.y += y / camera.zoom - y / zoom;
+    camera.zoom = zoom;
+}
+
+/* Move or zoom the camera depending on the SDL event. Returns true if the event
+ * was used. Since the camera doesn't affect the simulation, these events are
+ * not actions, and they are not recorded. */
+static bool handle_camera_event(const SDL_Event* sdl_event) {
+    switch (sdl_event->type) {
+        case SDL_KEYDOWN:
+            switch (sdl_event->key.keysym.scancode) {
+                case SDL_SCANCODE_LEFT:
+                    camera.x -= CAMERA_PAN_STEP / camera.zoom;
+                    return true;
+                case SDL_SCANCODE_RIGHT:
+                    camera.x += CAMERA_PAN_STEP / camera.zoom;
+                    return true;
+                case SDL_SCANCODE_UP:
+                    camera.y -= CAMERA_PAN_STEP / camera.zoom;
+                    return true;
+                case SDL_SCANCODE_DOWN:
+                    camera.y += CAMERA_PAN_STEP / camera.zoom;
+                    return true;
+                case SDL_SCANCODE_EQUALS:
+                    camera_zoom(CAMERA_ZOOM_STEP, GRID_W / 2, GRID_H / 2);
+                    return true;
+                case SDL_SCANCODE_MINUS:
+                    camera_zoom(1.f / CAMERA_ZOOM_STEP, GRID_W / 2, GRID_H / 2);
+                    return true;
+                case SDL_SCANCODE_HOME:
+                    camera.x    = 0.f;
+                    camera.y    = 0.f;
+                    camera.zoom = 1.f;
+                    return true;
+                default:
+                    return false;
+            } /* End scancode switch */
+        case SDL_MOUSEMOTION:
+            /* Drag with the middle mouse button */
+            if ((sdl_event->motion.state & SDL_BUTTON_MMASK) == 0)
+                return false;
+
+            camera.x -= sdl_event->motion.xrel / camera.zoom;
+            camera.y -= sdl_event->motion.yrel / camera.zoom;
+            return true;
+        case SDL_MOUSEWHEEL: {
+            /* Without Ctrl, the wheel changes the mass */
+            if ((SDL_GetModState() & KMOD_CTRL) == 0)
+                return false;
+
+            int mouse_x, mouse_y;
+            SDL_GetMouseState(&mouse_x, &mouse_y);
+            camera_zoom((sdl_event->wheel.y > 0) ? CAMERA_ZOOM_STEP
+                                                 : 1.f / CAMERA_ZOOM_STEP,
+                        mouse_x, mouse_y);
+            return true;
+        }
+        default:
+            return false;
+    } /* End event.type switch */
+}
+
+/*----------------------------------------------------------------------------*/
+/* Frame export */
+
+/*
+ * Frames can be exported to a raw video stream, in a file or a pipe. They are
+ * rendered with `render_grid' into an offscreen surface, so it also works
+ * without a window, and copied to a bounded queue of EXPORT_QUEUE frames. A
+ * separate thread converts them and writes them, so the simulation only waits
+ * when the queue is full.
+ *
+ * The format depends on the extension of the file: YUV4MPEG2 (.y4m) with 4:2:0
+ * chroma, or a stream of binary PPM images otherwise. Both can be read by
+ * ffmpeg, for example:
+ *
+ *   ./orbit.out --replay session.orbj --export - | ffmpeg -i - out.mp4
+ */
+
+typedef enum EExportFormat {
+    EXPORT_PPM = 0,
+    EXPORT_Y4M = 1,
+} EExportFormat;
+
+typedef struct Exporter {
+    FILE* fp;
+    EExportFormat format;
+
+    /* Offscreen target of `render_grid' */
+    SDL_Surface* surface;
+    SDL_Renderer* renderer;
+
+    /* Circular queue of frames in ARGB8888, waiting to be encoded */
+    uint32_t* frames;
+    size_t head, count;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty, not_full;
+
+    /* Set when there will be no more frames, and when a write failed */
+    bool done, failed;
+
+    /* Encoder thread, and its conversion buffer */
+    pthread_t thread;
+    uint8_t* buffer;
+} Exporter;
+
+static Exporter exporter;
+
+/* Convert a frame to the export format, and write it */
+static bool export_encode(const uint32_t* pixels) {
+    uint8_t* buffer = exporter.buffer;
+    size_t size;
+
+    if (exporter.format == EXPORT_Y4M) {
+        /* Full range BT.601, with the chroma averaged in 2x2 blocks */
+        uint8_t* plane_y  = buffer;
+        uint8_t* plane_cb = plane_y + GRID_W * GRID_H;
+        uint8_t* plane_cr = plane_cb + (GRID_W / 2) * (GRID_H / 2);
+
+        for (int y = 0; y < GRID_H; y += 2) {
+            for (int x = 0; x < GRID_W; x += 2) {
+                int sum_r = 0, sum_g = 0, sum_b = 0;
+
+                for (int i = 0; i < 4; i++) {
+                    const size_t pixel = (y + i / 2) * GRID_W + x + i % 2;
+                    const int r        = (pixels[pixel] >> 16) & 0xFF;
+                    const int g        = (pixels[pixel] >> 8) & 0xFF;
+                    const int b        = pixels[pixel] & 0xFF;
+
+                    plane_y[pixel] = (77 * r + 150 * g + 29 * b + 128) >> 8;
+                    sum_r += r;
+                    sum_g += g;
+                    sum_b += b;
+                }
+
+                /* Only pure blue or red can round above 255 */
+                const int cb =
+                  (-43 * sum_r - 85 * sum_g + 128 * sum_b + 1024 * 128 + 512) >>
+                  10;
+                const int cr =
+                  (128 * sum_r - 107 * sum_g - 21 * sum_b + 1024 * 128 + 512) >>
+                  10;
+
+                const size_t chroma = (y / 2) * (GRID_W / 2) + x / 2;
+                plane_cb[chroma]    = (cb > 255) ? 255 : cb;
+                plane_cr[chroma]    = (cr > 255) ? 255 : cr;
+            }
+        }
+
+        size = GRID_W * GRID_H + 2 * (GRID_W / 2) * (GRID_H / 2);
+        if (fputs("FRAME\n", exporter.fp) == EOF)
+            return false;
+    } else {
+        for (size_t i = 0; i < GRID_W * GRID_H; i++) {
+            buffer[i * 3]     = (pixels[i] >> 16) & 0xFF;
+            buffer[i * 3 + 1] = (pixels[i] >> 8) & 0xFF;
+            buffer[i * 3 + 2] = pixels[i] & 0xFF;
+        }
+
+        size = GRID_W * GRID_H * 3;
+        if (fprintf(exporter.fp, "P6\n%d %d\n255\n", GRID_W, GRID_H) < 0)
+            return false;
+    }
+
+    return fwrite(buffer, size, 1, exporter.fp) == 1;
+}
+
+static void* export_thread(void* arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&exporter.mutex);
+    for (;;) {
+        while (exporter.count == 0 && !exporter.done)
+            pthread_cond_wait(&exporter.not_empty, &exporter.mutex);
+        if (exporter.count == 0)
+            break;
+
+        /* The frame stays in the queue until it's written, so it's not
+         * overwritten */
+        const uint32_t* frame =
+          &exporter.frames[exporter.head * GRID_W * GRID_H];
+        pthread_mutex_unlock(&exporter.mutex);
+
+        const bool written = !exporter.failed && export_encode(frame);
+
+        pthread_mutex_lock(&exporter.mutex);
+        if (!written)
+            exporter.failed = true;
+        exporter.head = (exporter.head + 1) % EXPORT_QUEUE;
+        exporter.count--;
+        pthread_cond_signal(&exporter.not_full);
+    }
+    pthread_mutex_unlock(&exporter.mutex);
+
+    return NULL;
+}
+
+/* Start exporting frames to `path', or to stdout if it's "-" */
+static void export_open(const char* path) {
+    const char* extension = strrchr(path, '.');
+    exporter.format       = (extension && strcmp(extension, ".y4m") == 0)
+                              ? EXPORT_Y4M
+                              : EXPORT_PPM;
+
+    exporter.fp = (strcmp(path, "-") == 0) ? stdout : fopen(path, "wb");
+    if (!exporter.fp)
+        die("Unable to open export file: %s", path);
+
+    exporter.surface = SDL_CreateRGBSurfaceWithFormat(
+      0, GRID_W, GRID_H, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (!exporter.surface)
+        die("Unable to create export surface: %s", SDL_GetError());
+
+    exporter.renderer = SDL_CreateSoftwareRenderer(exporter.surface);
+    if (!exporter.renderer)
+        die("Unable to create export renderer: %s", SDL_GetError());
+
+    exporter.frames =
+      malloc((size_t)EXPORT_QUEUE * GRID_W * GRID_H * sizeof(uint32_t));
+    exporter.buffer = malloc(GRID_W * GRID_H * 3);
+    if (!exporter.frames || !exporter.buffer)
+        die("Unable to allocate export queue.");
+
+    exporter.head   = 0;
+    exporter.count  = 0;
+    exporter.done   = false;
+    exporter.failed = false;
+    pthread_mutex_init(&exporter.mutex, NULL);
+    pthread_cond_init(&exporter.not_empty, NULL);
+    pthread_cond_init(&exporter.not_full, NULL);
+
+    /* The samples use the full range, see `export_encode'. Without the
+     * XCOLORRANGE tag, readers assume the limited one. */
+    if (exporter.format == EXPORT_Y4M &&
+        fprintf(exporter.fp,
+                "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n",
+                GRID_W, GRID_H, FPS) < 0)
+        die("Unable to write export header.");
+
+    if (pthread_create(&exporter.thread, NULL, export_thread, NULL) != 0)
+        die("Unable to create export thread.");
+}
+
+/* Render the current state, interpolated as in `render_grid', and add it to
+ * the queue. Waits if the queue is full. */
+static void export_frame(float alpha) {
+    if (!exporter.fp)
+        return;
+
+    set_render_color(exporter.renderer, 0x000000);
+    SDL_RenderClear(exporter.renderer);
+    render_grid(exporter.renderer, alpha);
+
+    pthread_mutex_lock(&exporter.mutex);
+    while (exporter.count == EXPORT_QUEUE)
+        pthread_cond_wait(&exporter.not_full, &exporter.mutex);
+    const size_t slot = (exporter.head + exporter.count) % EXPORT_QUEUE;
+    const bool failed = exporter.failed;
+    pthread_mutex_unlock(&exporter.mutex);
+
+    if (failed)
+        die("Unable to write exported frame.");
+
+    /* The slot is not visible to the encoder until the count is increased */
+    if (SDL_RenderReadPixels(exporter.renderer, NULL, SDL_PIXELFORMAT_ARGB8888,
+                             &exporter.frames[slot * GRID_W * GRID_H],
+                             GRID_W * sizeof(uint32_t)) != 0)
+        die("Unable to read exported frame: %s", SDL_GetError());
+
+    pthread_mutex_lock(&exporter.mutex);
+    exporter.count++;
+    pthread_cond_signal(&exporter.not_empty);
+    pthread_mutex_unlock(&exporter.mutex);
+}
+
+/* Wait for the queued frames to be written, and close the export file */
+static void export_close(void) {
+    if (!exporter.fp)
+        return;
+
+    pthread_mutex_lock(&exporter.mutex);
+    exporter.done = true;
+    pthread_cond_signal(&exporter.not_empty);
+    pthread_mutex_unlock(&exporter.mutex);
+    pthread_join(exporter.thread, NULL);
+
+    const bool failed =
+      exporter.failed ||
+      ((exporter.fp == stdout) ? fflush(stdout) : fclose(exporter.fp)) != 0;
+    exporter.fp = NULL;
+
+    pthread_mutex_destroy(&exporter.mutex);
+    pthread_cond_destroy(&exporter.not_empty);
+    pthread_cond_destroy(&exporter.not_full);
+    SDL_DestroyRenderer(exporter.renderer);
+    SDL_FreeSurface(exporter.surface);
+    free(exporter.frames);
+    free(exporter.buffer);
+
+    if (failed)
+        die("Unable to write exported frames.");
+}
+
+/*----------------------------------------------------------------------------*/
+/* Input journal */
+
+/*
+ * The input journal is a header with the initial settings, followed by every
+ * action in the order it was applied. Since the simulation only depends on
+ * them, replaying the journal with the same binary gives bit-identical
+ * results.
+ */
+
+/* Size of the header of each journal version */
+static const size_t journal_header_size[JOURNAL_VERSION + 1] = {
+    [1] = offsetof(JournalHeader, bounds_policy),
+    [2] = offsetof(JournalHeader, static_cache),
+    [3] = offsetof(JournalHeader, far_field),
+    [4] = offsetof(JournalHeader, far_field),
+    [5] = sizeof(JournalHeader),
+};
+
+static void journal_open(const char* path) {
+    journal = fopen(path, "wb");
+    if (!journal)
+        die("Unable to open journal for writing: %s", path);
+
+    /* Actions are small and frequent, use a big buffer */
+    setvbuf(journal, NULL, _IOFBF, 1 << 16);
+
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version        = JOURNAL_VERSION;
+    header.gravity_solver = gravity_solver;
+    header.fmm_order      = fmm_order;
+    header.pm_resolution  = pm_resolution;
+    header.pm_p3m         = pm_p3m;
+    header.current_mass   = current_mass;
+    header.current_bounce = current_bounce;
+    header.bounds_policy  = bounds_policy;
+    header.static_cache   = static_cache;
+    header.far_field      = far_field;
+
+    if (fwrite(&header, sizeof(header), 1, journal) != 1)
+        die("Unable to write journal header.");
+}
+
+static void journal_record(const Action* action) {
+    if (journal && fwrite(action, sizeof(Action), 1, journal) != 1)
+        die("Unable to write to journal.");
+}
+
+static void journal_close(void) {
+    if (journal && fclose(journal) != 0)
+        die("Unable to write to journal.");
+    journal = NULL;
+}
+
+/* Hash of the whole simulation state, using FNV-1a */
+static uint64_t state_checksum(void) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+
+#define HASH_FIELD(FIELD)                                     \
+    do {                                                      \
+        const uint8_t* bytes = (const uint8_t*)&(FIELD);      \
+        for (size_t i = 0; i < sizeof(FIELD); i++) {          \
+            hash ^= bytes[i];                                 \
+            hash *= 0x100000001B3ull;                         \
+        }                                                     \
+    } while (0)
+
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        HASH_FIELD(body->type);
+        HASH_FIELD(body->x);
+        HASH_FIELD(body->y);
+        HASH_FIELD(body->vel_x);
+        HASH_FIELD(body->vel_y);
+        HASH_FIELD(body->mass);
+    }
+
+#undef HASH_FIELD
+
+    return hash;
+}
+
+/*
+ * Replay a journal without a window, as fast as possible. Prints the speed and
+ * the checksum of the final state. If `expected' is not NULL, it's compared
+ * with the checksum, and the program exits with an error if they don't match.
+ */
+static void replay_journal(const char* path, const char* expected) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp)
+        die("Unable to open journal: %s", path);
+
+    /* Fields missing in older versions keep the settings they had before
+     * they were added. Changes to the solvers themselves are not versioned,
+     * so only the direct solver replays like in older binaries. */
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    header.bounds_policy = BOUNDS_OPEN;
+    header.static_cache  = false;
+    header.far_field     = false;
+
+    const size_t prefix = offsetof(JournalHeader, gravity_solver);
+    if (fread(&header, prefix, 1, fp) != 1 ||
+        memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0)
+        die("Invalid journal: %s", path);
+    if (header.version == 0 || header.version > JOURNAL_VERSION)
+        die("Unsupported journal version: %u", header.version);
+
+    const size_t size = journal_header_size[header.version];
+    if (fread((char*)&header + prefix, size - prefix, 1, fp) != 1)
+        die("Invalid journal: %s", path);
+
+    gravity_solver = header.gravity_solver % GRAVITY_SOLVER_COUNT;
+    fmm_order      = header.fmm_order;
+    pm_resolution  = header.pm_resolution;
+    pm_p3m         = header.pm_p3m;
+    current_mass   = header.current_mass;
+    current_bounce = header.current_bounce;
+    bounds_policy  = header.bounds_policy % BOUNDS_POLICY_COUNT;
+    static_cache   = header.static_cache;
+    far_field      = header.far_field;
+    clamp_settings();
+
+    bounce_collisions = header.version >= 4;
+
+    Action action;
+    bool have_action  = fread(&action, sizeof(action), 1, fp) == 1;
+    bool running      = true;
+    const double start = get_seconds();
+
+    /* Stop when the journal ends, even if the recording was interrupted
+     * before ACTION_QUIT */
+    while (running && have_action) {
+        while (have_action && action.step == sim_step) {
+            running = apply_action(&action);
+            if (!running)
+                break;
+
+            have_action = fread(&action, sizeof(action), 1, fp) == 1;
+        }
+
+        if (!running || !have_action)
+            break;
+
+        if (action.step < sim_step)
+            die("Invalid journal: actions are not in order.");
+
+        step_simulation();
+
+        /* Export one frame per step, if enabled */
+        export_frame(1.f);
+    }
+
+    /* The replay is not finished until the last frame is written */
+    const bool exporting_stdout = exporter.fp == stdout;
+    export_close();
+
+    const double elapsed = get_seconds() - start;
+    fclose(fp);
+
+    size_t num_bodies = 0;
+    for (Body* body = bodies; body != NULL; body = body->next)
+        num_bodies++;
+
+    /* Don't mix the results with the exported frames */
+    FILE* out = exporting_stdout ? stderr : stdout;
+
+    const uint64_t checksum = state_checksum();
+    fprintf(out,
+            "Replayed %llu steps with %zu bodies in %.3fs (%.1f steps/s)\n",
+            (unsigned long long)sim_step, num_bodies, elapsed,
+            sim_step / elapsed);
+    fprintf(out, "Checksum: %016llx\n", (unsigned long long)checksum);
+
+    free_bodies();
+    free_retired_bodies();
+
+    if (expected != NULL && strtoull(expected, NULL, 16) != checksum)
+        die("Checksum mismatch, expected %s.", expected);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Frame pacing */
+
+/*
+ * The simulation advances one step every 1/FPS seconds of real time, no matter
+ * how long each frame takes. The elapsed time is accumulated every frame and
+ * consumed in whole steps, and the remainder is used for interpolating the
+ * rendered positions.
+ *
+ * The cost of each substep and of rendering is measured. If there is time left
+ * in the frame, each step is divided in more substeps, which makes the
+ * simulation more accurate at the same speed. If there isn't, fewer substeps
+ * are used, and then more steps per frame, up to FRAME_MAX_STEPS.
+ */
+
+typedef struct FramePacer {
+    double last_time;    /* Start of the previous frame, in seconds */
+    double accumulator;  /* Time not simulated yet, in seconds */
+    double substep_cost; /* Average seconds spent in each substep */
+    double render_cost;  /* Average seconds spent rendering each frame */
+} FramePacer;
+
+static void frame_init(FramePacer* pacer) {
+    pacer->last_time    = get_seconds();
+    pacer->accumulator  = 0.0;
+    pacer->substep_cost = 0.0;
+    pacer->render_cost  = 0.0;
+}
+
+/* Accumulate the time since the previous frame. If the simulation is too far
+ * behind, the extra time is dropped. */
+static void frame_start(FramePacer* pacer) {
+    const double now = get_seconds();
+    pacer->accumulator += now - pacer->last_time;
+    pacer->last_time = now;
+
+    if (pacer->accumulator > FRAME_MAX_STEPS * FRAME_SECONDS)
+        pacer->accumulator = FRAME_MAX_STEPS * FRAME_SECONDS;
+}
+
+/* Number of substeps that fit in the frame for each of the `pending' steps.
+ * It grows by one at most on each step, so a single fast frame doesn't cause
+ * a slow one. */
+static int frame_substeps(const FramePacer* pacer, int pending) {
+    int result = FRAME_MAX_SUBSTEPS;
+
+    if (pacer->substep_cost > 0.0) {
+        const double budget =
+          FRAME_BUDGET * FRAME_SECONDS - pacer->render_cost;
+        const double fit = budget / (pending * pacer->substep_cost);
+
+        if (fit < 1.0)
+            result = 1;
+        else if (fit < FRAME_MAX_SUBSTEPS)
+            result = (int)fit;
+    }
+
+    if (result > sim_substeps + 1)
+        result = sim_substeps + 1;
+
+    return result;
+}
+
+/* Simulate one step of the accumulated time. The number of substeps is changed
+ * with an action, so it's recorded in the input journal. */
+static void frame_step(FramePacer* pacer) {
+    const int pending  = (int)(pacer->accumulator / FRAME_SECONDS);
+    const int substeps = frame_substeps(pacer, pending);
+    if (substeps != sim_substeps) {
+        Action action;
+        memset(&action, 0, sizeof(Action));
+        action.step  = sim_step;
+        action.type  = ACTION_SET_SUBSTEPS;
+        action.value = substeps;
+
+        journal_record(&action);
+        apply_action(&action);
+    }
+
+    const double start = get_seconds();
+    step_simulation();
+    const double cost = (get_seconds() - start) / sim_substeps;
+
+    pacer->substep_cost += (cost - pacer->substep_cost) * FRAME_SMOOTHING;
+    pacer->accumulator -= FRAME_SECONDS;
+}
+
+/* Render the bodies, interpolating with the time not simulated yet */
+static void frame_render(FramePacer* pacer, SDL_Renderer* rend) {
+    const double start = get_seconds();
+    render_grid(rend, pacer->accumulator / FRAME_SECONDS);
+    const double cost = get_seconds() - start;
+
+    pacer->render_cost += (cost - pacer->render_cost) * FRAME_SMOOTHING;
+}
+
+/* Sleep until the next step is due, if the renderer didn't wait already */
+static void frame_wait(const FramePacer* pacer) {
+    const double remaining = FRAME_SECONDS - pacer->accumulator -
+                             (get_seconds() - pacer->last_time);
+    if (remaining >= 0.001)
+        SDL_Delay((Uint32)(remaining * 1000.0));
+}
+
+/*----------------------------------------------------------------------------*/
+/* Ensemble runner */
+
+/*
+ * The ensemble runner simulates many small, independent scenes in the same
+ * process, without a window. Every scene has the same layout: a static body in
+ * the center of the window, and `ensemble_bodies' - 1 dynamic bodies on a
+ * ring around it. What changes are the parameters in `EnsembleScene'.
+ *
+ * Scenes are grouped in batches of ENSEMBLE_LANES, stored so the same body of
+ * every scene in the batch is contiguous. The physics loops go over the scenes
+ * in the innermost loop, without branches, so the compiler can vectorize them
+ * even when each scene has few bodies. Batches are distributed across threads.
+ */
+
+/* Parameters of each scene, read from the specification file */
+typedef struct EnsembleScene {
+    float mass;         /* Mass of all bodies, as `current_mass' */
+    float bounce;       /* Collision restitution, as `current_bounce' */
+    float vel_x, vel_y; /* Initial velocity of the dynamic bodies */
+} EnsembleScene;
+
+/* Summary of each scene after the simulation */
+typedef struct EnsembleSummary {
+    float kinetic_energy;
+    float center_x, center_y; /* Center of mass of the dynamic bodies */
+    float max_speed;
+    uint32_t collisions; /* Times that two bodies started touching */
+    uint32_t escaped;    /* Dynamic bodies outside of the window */
+} EnsembleSummary;
+
+typedef struct Ensemble {
+    const EnsembleScene* scenes;
+    EnsembleSummary* summaries;
+    size_t num_scenes;
+    uint64_t steps;
+
+    /* Next batch to be simulated by any thread */
+    atomic_size_t next_batch;
+} Ensemble;
+
+/* Scene lanes, see `ensemble_run_batch' */
+typedef float Lanes[ENSEMBLE_LANES];
+
+/*
+ * Apply the acceleration of body 'b' to body 'a' in every lane, as in
+ * `apply_acceleration'. The result of the collision and the attraction are
+ * both calculated, and the right one is selected without branches.
+ *
+ * The `contact' of the pair is whether it was colliding in the previous step,
+ * so `collisions' only counts when the bodies start touching. Each pair is
+ * called in both orders, so one of them receives a scratch counter.
+ */
+static void ensemble_pair(const float* restrict a_x, const float* restrict a_y,
+                          float* restrict a_vel_x, float* restrict a_vel_y,
+                          const float* restrict b_x, const float* restrict b_y,
+                          const float* restrict mass,
+                          const float* restrict bounce,
+                          float* restrict contact,
+                          float* restrict collisions) {
+    for (int l = 0; l < ENSEMBLE_LANES; l++) {
+        const float dx       = b_x[l] - a_x[l];
+        const float dy       = b_y[l] - a_y[l];
+        const float distance = sqrtf(dx * dx + dy * dy);
+        const float nx       = dx / distance;
+        const float ny       = dy / distance;
+
+        /* Colliding, bounce back */
+        const float dot_product = a_vel_x[l] * nx + a_vel_y[l] * ny;
+        const float bounce_x =
+          a_vel_x[l] - (1.f + bounce[l]) * dot_product * nx;
+        const float bounce_y =
+          a_vel_y[l] - (1.f + bounce[l]) * dot_product * ny;
+
+        /* Not colliding, attract */
+        const float acc     = mass[l] / (distance * distance);
+        const float attract_x = a_vel_x[l] + acc * nx;
+        const float attract_y = a_vel_y[l] + acc * ny;
+
+        /* All bodies of a scene have the same width */
+        const float colliding = (2.f * mass[l] >= distance) ? 1.f : 0.f;
+        a_vel_x[l] = attract_x + colliding * (bounce_x - attract_x);
+        a_vel_y[l] = attract_y + colliding * (bounce_y - attract_y);
+        collisions[l] += colliding * (1.f - contact[l]);
+        contact[l] = colliding;
+    }
+}
+
+/* Simulate the batch of scenes starting at `first'. If there are not enough
+ * scenes to fill the lanes, the last one is repeated. */
+static void ensemble_run_batch(Ensemble* ensemble, size_t first) {
+    const int num_bodies = ensemble_bodies;
+
+    Lanes* x     = malloc(num_bodies * sizeof(Lanes));
+    Lanes* y     = malloc(num_bodies * sizeof(Lanes));
+    Lanes* vel_x = malloc(num_bodies * sizeof(Lanes));
+    Lanes* vel_y = malloc(num_bodies * sizeof(Lanes));
+    if (!x || !y || !vel_x || !vel_y)
+        die("Unable to allocate ensemble batch.");
+
+    /* Whether each pair was colliding, see `ensemble_pair' */
+    Lanes* contact = calloc((size_t)num_bodies * num_bodies, sizeof(Lanes));
+    if (!contact)
+        die("Unable to allocate ensemble batch.");
+
+    Lanes mass, bounce, collisions, scratch;
+    for (int l = 0; l < ENSEMBLE_LANES; l++) {
+        size_t scene = first + l;
+        if (scene >= ensemble->num_scenes)
+            scene = ensemble->num_scenes - 1;
+
+        const EnsembleScene* params = &ensemble->scenes[scene];
+        mass[l]       = params->mass;
+        bounce[l]     = params->bounce;
+        collisions[l] = 0.f;
+        scratch[l]    = 0.f;
+
+        /* The first body is the static one, in the center */
+        x[0][l]     = GRID_W / 2.f;
+        y[0][l]     = GRID_H / 2.f;
+        vel_x[0][l] = 0.f;
+        vel_y[0][l] = 0.f;
+
+        for (int i = 1; i < num_bodies; i++) {
+            const float angle = 2.f * (float)M_PI * (i - 1) / (num_bodies - 1);
+            x[i][l]     = GRID_W / 2.f + ENSEMBLE_RING_RADIUS * cosf(angle);
+            y[i][l]     = GRID_H / 2.f + ENSEMBLE_RING_RADIUS * sinf(angle);
+            vel_x[i][l] = params->vel_x;
+            vel_y[i][l] = params->vel_y;
+        }
+    }
+
+    for (uint64_t step = 0; step < ensemble->steps; step++) {
+        for (int a = 1; a < num_bodies; a++)
+            for (int b = 0; b < num_bodies; b++)
+                if (a != b)
+                    ensemble_pair(x[a], y[a], vel_x[a], vel_y[a], x[b], y[b],
+                                  mass, bounce, contact[a * num_bodies + b],
+                                  (b < a) ? collisions : scratch);
+
+        for (int a = 1; a < num_bodies; a++) {
+            for (int l = 0; l < ENSEMBLE_LANES; l++) {
+                x[a][l] += vel_x[a][l];
+                y[a][l] += vel_y[a][l];
+            }
+        }
+    }
+
+    for (int l = 0; l < ENSEMBLE_LANES && first + l < ensemble->num_scenes;
+         l++) {
+        EnsembleSummary* summary = &ensemble->summaries[first + l];
+        memset(summary, 0, sizeof(EnsembleSummary));
+
+        for (int a = 1; a < num_bodies; a++) {
+            const float speed_sq =
+              vel_x[a][l] * vel_x[a][l] + vel_y[a][l] * vel_y[a][l];
+
+            summary->kinetic_energy += 0.5f * mass[l] * speed_sq;
+            summary->center_x += x[a][l];
+            summary->center_y += y[a][l];
+            summary->max_speed = fmaxf(summary->max_speed, sqrtf(speed_sq));
+
+            if (x[a][l] < 0.f || y[a][l] < 0.f || x[a][l] >= GRID_W ||
+                y[a][l] >= GRID_H)
+                summary->escaped++;
+        }
+
+        summary->center_x /= num_bodies - 1;
+        summary->center_y /= num_bodies - 1;
+        summary->collisions = (uint32_t)collisions[l];
+    }
+
+    free(contact);
+    free(x);
+    free(y);
+    free(vel_x);
+    free(vel_y);
+}
+
+static void* ensemble_worker(void* arg) {
+    Ensemble* ensemble = arg;
+
+    for (;;) {
+        const size_t batch = atomic_fetch_add(&ensemble->next_batch, 1);
+        const size_t first = batch * ENSEMBLE_LANES;
+        if (first >= ensemble->num_scenes)
+            break;
+
+        ensemble_run_batch(ensemble, first);
+    }
+
+    return NULL;
+}
+
+/* Read the scenes from a file with one scene per line, in the format:
+ *   mass bounce vel_x vel_y
+ * Empty lines and lines starting with '#' are ignored. */
+static EnsembleScene* ensemble_read_scenes(const char* path,
+                                           size_t* num_scenes) {
+    FILE* fp = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+    if (!fp)
+        die("Unable to open ensemble file: %s", path);
+
+    size_t capacity       = 64;
+    EnsembleScene* scenes = malloc(capacity * sizeof(EnsembleScene));
+    if (!scenes)
+        die("Unable to allocate ensemble scenes.");
+
+    *num_scenes = 0;
+    char line[256];
+    for (int line_num = 1; fgets(line, sizeof(line), fp); line_num++) {
+        const char* start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\0')
+            continue;
+
+        if (*num_scenes == capacity) {
+            capacity *= 2;
+            scenes = realloc(scenes, capacity * sizeof(EnsembleScene));
+            if (!scenes)
+                die("Unable to allocate ensemble scenes.");
+        }
+
+        EnsembleScene* scene = &scenes[*num_scenes];
+        if (sscanf(start, "%f %f %f %f", &scene->mass, &scene->bounce,
+                   &scene->vel_x, &scene->vel_y) != 4)
+            die("Invalid scene in %s:%d", path, line_num);
+
+        (*num_scenes)++;
+    }
+
+    if (fp != stdin)
+        fclose(fp);
+
+    if (*num_scenes == 0)
+        die("No scenes in ensemble file: %s", path);
+
+    return scenes;
+}
+
+/* Run every scene in `scenes_path' for `steps' steps, and write a CSV file
+ * with the summary of each scene to `out_path', or stdout if NULL. */
+static void run_ensemble(const char* scenes_path, const char* out_path,
+                         uint64_t steps, int num_threads) {
+    Ensemble ensemble;
+    ensemble.scenes = ensemble_read_scenes(scenes_path, &ensemble.num_scenes);
+    ensemble.summaries = malloc(ensemble.num_scenes * sizeof(EnsembleSummary));
+    ensemble.steps     = steps;
+    atomic_init(&ensemble.next_batch, 0);
+    if (!ensemble.summaries)
+        die("Unable to allocate ensemble summaries.");
+
+    if (num_threads <= 0)
+        num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads <= 0)
+        num_threads = 1;
+
+    const double start = get_seconds();
+
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    if (!threads)
+        die("Unable to allocate ensemble threads.");
+    for (int i = 0; i < num_threads; i++)
+        if (pthread_create(&threads[i], NULL, ensemble_worker, &ensemble) != 0)
+            die("Unable to create ensemble thread.");
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    const double elapsed = get_seconds() - start;
+
+    FILE* out = (out_path == NULL) ? stdout : fopen(out_path, "w");
+    if (!out)
+        die("Unable to open ensemble output: %s", out_path);
+
+    fprintf(out, "scene,mass,bounce,vel_x,vel_y,kinetic_energy,center_x,"
+                 "center_y,max_speed,collisions,escaped\n");
+    for (size_t i = 0; i < ensemble.num_scenes; i++) {
+        const EnsembleScene* scene     = &ensemble.scenes[i];
+        const EnsembleSummary* summary = &ensemble.summaries[i];
+        fprintf(out, "%zu,%g,%g,%g,%g,%g,%g,%g,%g,%u,%u\n", i, scene->mass,
+                scene->bounce, scene->vel_x, scene->vel_y,
+                summary->kinetic_energy, summary->center_x, summary->center_y,
+                summary->max_speed, summary->collisions, summary->escaped);
+    }
+
+    if (out != stdout && fclose(out) != 0)
+        die("Unable to write ensemble output: %s", out_path);
+
+    fprintf(stderr, "Simulated %zu scenes of %d bodies for %llu steps in %.3fs "
+                    "with %d threads\n",
+            ensemble.num_scenes, ensemble_bodies, (unsigned long long)steps,
+            elapsed, num_threads);
+
+    free((void*)ensemble.scenes);
+    free(ensemble.summaries);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Domain decomposition */
+
+/*
+ * With `--domains N', the simulation runs without a window in N worker
+ * processes. The world is split in vertical slabs, each one owned by a worker,
+ * which keeps the bodies inside of it in its own `bodies' list. On each step,
+ * every domain publishes:
+ *
+ *   - Its boundary bodies, the ones within DOMAIN_HALO of the edges of its
+ *     slab. Other domains near them calculate them directly, including
+ *     collisions.
+ *   - A summary of all of its bodies: the mass and center of mass of each cell
+ *     of a coarse grid. The other domains are attracted by these cells, after
+ *     removing the boundary bodies that they already calculated directly.
+ *
+ * After moving, the bodies that left their slab are sent to their new domain.
+ * Every DOMAIN_REBALANCE steps, the domains also publish a histogram of the X
+ * positions of their bodies, and if the number of bodies is too uneven, all of
+ * them calculate the same new slabs from it.
+ *
+ * The data is exchanged through a `Transport', so the domains don't depend on
+ * how it's sent. For now, the only backend uses POSIX shared memory, for
+ * workers on the same machine.
+ */
+
+/* Body sent to another domain */
+typedef struct DomainBody {
+    float x, y;
+    float vel_x, vel_y;
+    float mass;
+    uint32_t type; /* EBodyType */
+    int32_t rank;  /* Destination, for migrating bodies */
+} DomainBody;
+
+/* Sum of the bodies of a domain in a cell of the coarse grid */
+typedef struct DomainCell {
+    double mass;
+    double mass_x, mass_y; /* Positions weighted by mass */
+} DomainCell;
+
+/* Data published by a domain in each exchange. Depending on the phase, the
+ * bodies are the boundary bodies or the migrating ones. */
+typedef struct DomainExport {
+    uint32_t num_local; /* Bodies owned by the domain */
+    uint32_t histogram[DOMAIN_BINS];
+    DomainCell cells[DOMAIN_CELLS_W * DOMAIN_CELLS_H];
+
+    /* Statistics, published at the end */
+    uint64_t migrations;
+    uint32_t rebalances;
+    DomainCell total;
+
+    uint32_t num_bodies;
+    DomainBody bodies[];
+} DomainExport;
+
+/* Interface between the domains, implemented by each backend */
+typedef struct Transport {
+    int rank;
+    int num_domains;
+
+    /* Buffer for the data published by this domain in the next exchange */
+    DomainExport* (*outbox)(struct Transport* transport);
+
+    /* Publish the outbox, and wait until every domain did the same */
+    void (*exchange)(struct Transport* transport);
+
+    /* Data published by domain `rank' in the last exchange */
+    const DomainExport* (*inbox)(const struct Transport* transport, int rank);
+
+    /* Data of the backend */
+    void* data;
+} Transport;
+
+/*
+ * Shared memory backend. Every domain has two export buffers in the same
+ * segment, used in alternate exchanges, so a domain can fill the next one while
+ * the others are still reading the last one. The segment is mapped before
+ * forking the workers, so they all inherit it.
+ */
+typedef struct ShmTransport {
+    pthread_barrier_t* barrier;
+    uint8_t* exports;
+    size_t export_size;
+    uint64_t phase; /* Number of exchanges */
+} ShmTransport;
+
+static DomainExport* shm_export(const Transport* transport, uint64_t phase,
+                                int rank) {
+    const ShmTransport* shm = transport->data;
+    const size_t index = (phase % 2) * transport->num_domains + rank;
+    return (DomainExport*)(shm->exports + index * shm->export_size);
+}
+
+static DomainExport* shm_outbox(Transport* transport) {
+    const ShmTransport* shm = transport->data;
+    return shm_export(transport, shm->phase, transport->rank);
+}
+
+static void shm_exchange(Transport* transport) {
+    ShmTransport* shm = transport->data;
+    pthread_barrier_wait(shm->barrier);
+    shm->phase++;
+}
+
+static const DomainExport* shm_inbox(const Transport* transport, int rank) {
+    const ShmTransport* shm = transport->data;
+    return shm_export(transport, shm->phase - 1, rank);
+}
+
+/* Create the shared memory segment for `num_domains' domains, each one sending
+ * up to `capacity' bodies per exchange */
+static void shm_transport_open(Transport* transport, int num_domains,
+                               size_t capacity) {
+    ShmTransport* shm = malloc(sizeof(ShmTransport));
+    if (!shm)
+        die("Unable to allocate transport.");
+
+    /* Keep every export aligned to a cache line */
+    const size_t header_size = (sizeof(pthread_barrier_t) + 63) & ~(size_t)63;
+    shm->export_size =
+      (sizeof(DomainExport) + capacity * sizeof(DomainBody) + 63) &
+      ~(size_t)63;
+    shm->phase = 0;
+
+    const size_t size = header_size + 2 * num_domains * shm->export_size;
+
+    /* The name is removed as soon as the segment is mapped, the workers only
+     * need the mapping */
+    char name[64];
+    snprintf(name, sizeof(name), "/orbit-%d", (int)getpid());
+    const int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        die("Unable to create shared memory: %s", name);
+
+    void* segment = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        segment =
+          mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    shm_unlink(name);
+    close(fd);
+    if (segment == MAP_FAILED)
+        die("Unable to map shared memory of %zu bytes.", size);
+
+    shm->barrier = segment;
+    shm->exports = (uint8_t*)segment + header_size;
+
+    pthread_barrierattr_t attr;
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (pthread_barrier_init(shm->barrier, &attr, num_domains) != 0)
+        die("Unable to create shared barrier.");
+    pthread_barrierattr_destroy(&attr);
+
+    transport->rank        = 0;
+    transport->num_domains = num_domains;
+    transport->outbox      = shm_outbox;
+    transport->exchange    = shm_exchange;
+    transport->inbox       = shm_inbox;
+    transport->data        = shm;
+}
+
+static void shm_transport_close(Transport* transport) {
+    ShmTransport* shm = transport->data;
+
+    const size_t header_size = (sizeof(pthread_barrier_t) + 63) & ~(size_t)63;
+    const size_t size =
+      header_size + 2 * transport->num_domains * shm->export_size;
+
+    pthread_barrier_destroy(shm->barrier);
+    munmap(shm->barrier, size);
+    free(shm);
+    transport->data = NULL;
+}
+
+/* Cell of the coarse grid for a position. Positions outside of the window are
+ * added to the closest cell. */
+static inline size_t domain_cell(float x, float y) {
+    int cx = (int)floorf(x / DOMAIN_CELL);
+    int cy = (int)floorf(y / DOMAIN_CELL);
+    cx     = (cx < 0) ? 0 : (cx >= DOMAIN_CELLS_W) ? DOMAIN_CELLS_W - 1 : cx;
+    cy     = (cy < 0) ? 0 : (cy >= DOMAIN_CELLS_H) ? DOMAIN_CELLS_H - 1 : cy;
+    return cy * DOMAIN_CELLS_W + cx;
+}
+
+/* Histogram bin for a X position, see `domain_split' */
+static inline size_t domain_bin(float x) {
+    const int bin = (int)floorf(x / GRID_W * DOMAIN_BINS);
+    return (bin < 0) ? 0 : (bin >= DOMAIN_BINS) ? DOMAIN_BINS - 1 : bin;
+}
+
+/* Domain that owns a X position, given the edges of the slabs */
+static int domain_owner(const float* bounds, int num_domains, float x) {
+    int rank = 0;
+    while (rank < num_domains - 1 && x >= bounds[rank + 1])
+        rank++;
+    return rank;
+}
+
+/* Calculate the edges of the slabs so they have the same number of bodies,
+ * given a histogram of their X positions. The first and last slabs extend
+ * forever. */
+static void domain_split(const uint32_t* histogram, int num_domains,
+                         float* bounds) {
+    uint64_t total = 0;
+    for (int i = 0; i < DOMAIN_BINS; i++)
+        total += histogram[i];
+
+    bounds[0]           = -INFINITY;
+    bounds[num_domains] = INFINITY;
+
+    uint64_t sum = 0;
+    int bin      = 0;
+    for (int rank = 1; rank < num_domains; rank++) {
+        const uint64_t target = total * rank / num_domains;
+        while (bin < DOMAIN_BINS && sum + histogram[bin] <= target)
+            sum += histogram[bin++];
+
+        bounds[rank] = (float)bin * GRID_W / DOMAIN_BINS;
+    }
+}
+
+static inline void domain_export_body(DomainBody* dst, const Body* src,
+                                      int rank) {
+    dst->x     = src->x;
+    dst->y     = src->y;
+    dst->vel_x = src->vel_x;
+    dst->vel_y = src->vel_y;
+    dst->mass  = src->mass;
+    dst->type  = src->type;
+    dst->rank  = rank;
+}
+
+static inline void domain_import_body(Body* dst, const DomainBody* src) {
+    dst->type   = src->type;
+    dst->x      = src->x;
+    dst->y      = src->y;
+    dst->prev_x = src->x;
+    dst->prev_y = src->y;
+    dst->vel_x  = src->vel_x;
+    dst->vel_y  = src->vel_y;
+    dst->mass   = src->mass;
+}
+
+static inline void domain_cell_add(DomainCell* cell, float x, float y,
+                                   float mass) {
+    cell->mass += mass;
+    cell->mass_x += (double)mass * x;
+    cell->mass_y += (double)mass * y;
+}
+
+/* Send the bodies outside of this domain to their owners, and receive the ones
+ * sent to this domain. Returns the number of bodies sent. */
+static size_t domain_migrate(Transport* transport, const float* bounds) {
+    const int rank    = transport->rank;
+    DomainExport* out = transport->outbox(transport);
+    out->num_bodies   = 0;
+
+    Body* prev = NULL;
+    Body* body = bodies;
+    while (body != NULL) {
+        Body* next = body->next;
+
+        if (body->x < bounds[rank] || body->x >= bounds[rank + 1]) {
+            const int owner =
+              domain_owner(bounds, transport->num_domains, body->x);
+            domain_export_body(&out->bodies[out->num_bodies++], body, owner);
+
+            /* The previous body stays the same */
+            retire_body(prev, body);
+            body = next;
+            continue;
+        }
+
+        prev = body;
+        body = next;
+    }
+
+    const size_t num_sent = out->num_bodies;
+    transport->exchange(transport);
+
+    for (int other = 0; other < transport->num_domains; other++) {
+        if (other == rank)
+            continue;
+
+        const DomainExport* in = transport->inbox(transport, other);
+        for (uint32_t i = 0; i < in->num_bodies; i++) {
+            if (in->bodies[i].rank != rank)
+                continue;
+
+            add_body(in->bodies[i].x, in->bodies[i].y, in->bodies[i].type);
+            domain_import_body(last_body, &in->bodies[i]);
+        }
+    }
+
+    return num_sent;
+}
+
+/* If the number of bodies of the domains is too uneven, move the edges of the
+ * slabs and migrate the bodies. Every domain gets the same histograms, so they
+ * all calculate the same edges. Returns true if the slabs changed. */
+static bool domain_rebalance(Transport* transport, float* bounds) {
+    DomainExport* out = transport->outbox(transport);
+    memset(out->histogram, 0, sizeof(out->histogram));
+    out->num_local = 0;
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        out->histogram[domain_bin(body->x)]++;
+        out->num_local++;
+    }
+
+    transport->exchange(transport);
+
+    static uint32_t histogram[DOMAIN_BINS];
+    memset(histogram, 0, sizeof(histogram));
+    uint64_t total = 0, biggest = 0;
+    for (int rank = 0; rank < transport->num_domains; rank++) {
+        const DomainExport* in = transport->inbox(transport, rank);
+        for (int i = 0; i < DOMAIN_BINS; i++)
+            histogram[i] += in->histogram[i];
+
+        total += in->num_local;
+        if (in->num_local > biggest)
+            biggest = in->num_local;
+    }
+
+    if (biggest <= DOMAIN_IMBALANCE * total / transport->num_domains)
+        return false;
+
+    domain_split(histogram, transport->num_domains, bounds);
+    domain_migrate(transport, bounds);
+    return true;
+}
+
+/* Publish the boundary bodies and the summary of this domain. Returns the
+ * bodies of other domains close enough to be calculated directly in `halo',
+ * and the sum of the rest in `cells'. */
+static size_t domain_exchange_halo(Transport* transport, const float* bounds,
+                                   Body* halo, DomainCell* cells) {
+    const int rank    = transport->rank;
+    const float lo    = bounds[rank];
+    const float hi    = bounds[rank + 1];
+    DomainExport* out = transport->outbox(transport);
+
+    memset(out->cells, 0, sizeof(out->cells));
+    out->num_bodies = 0;
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        domain_cell_add(&out->cells[domain_cell(body->x, body->y)], body->x,
+                        body->y, body->mass);
+
+        if (body->x - lo < DOMAIN_HALO || hi - body->x < DOMAIN_HALO)
+            domain_export_body(&out->bodies[out->num_bodies++], body, rank);
+    }
+
+    transport->exchange(transport);
+
+    memset(cells, 0, sizeof(out->cells));
+    size_t num_halo = 0;
+    for (int other = 0; other < transport->num_domains; other++) {
+        if (other == rank)
+            continue;
+
+        const DomainExport* in = transport->inbox(transport, other);
+        for (int i = 0; i < DOMAIN_CELLS_W * DOMAIN_CELLS_H; i++) {
+            cells[i].mass += in->cells[i].mass;
+            cells[i].mass_x += in->cells[i].mass_x;
+            cells[i].mass_y += in->cells[i].mass_y;
+        }
+
+        /* Boundary bodies close to this domain are removed from the cells */
+        for (uint32_t i = 0; i < in->num_bodies; i++) {
+            const DomainBody* body = &in->bodies[i];
+            if (body->x <= lo - DOMAIN_HALO || body->x >= hi + DOMAIN_HALO)
+                continue;
+
+            domain_import_body(&halo[num_halo++], body);
+            domain_cell_add(&cells[domain_cell(body->x, body->y)], body->x,
+                            body->y, -body->mass);
+        }
+    }
+
+    return num_halo;
+}
+
+/* Calculate and apply gravity accelerations to the bodies of this domain. The
+ * other bodies in the domain and in `halo' are calculated directly, as in
+ * `apply_accelerations', and the rest by cells. */
+static void domain_apply_gravity(Body* halo, size_t num_halo,
+                                 const DomainCell* cells) {
+    enum { NUM_CELLS = DOMAIN_CELLS_W * DOMAIN_CELLS_H };
+    static float cell_x[NUM_CELLS], cell_y[NUM_CELLS], cell_mass[NUM_CELLS];
+
+    /* Center of mass of each cell. Cells where every body was removed might
+     * have some rounding error left. */
+    for (int i = 0; i < NUM_CELLS; i++) {
+        cell_mass[i] = (cells[i].mass > 1e-6) ? (float)cells[i].mass : 0.f;
+        if (cell_mass[i] > 0.f) {
+            cell_x[i] = (float)(cells[i].mass_x / cells[i].mass);
+            cell_y[i] = (float)(cells[i].mass_y / cells[i].mass);
+        }
+    }
+
+    for (Body* a = bodies; a != NULL; a = a->next) {
+        /* Static bodies don't move */
+        if (a->type == BODY_STATIC)
+            continue;
+
+        for (Body* b = bodies; b != NULL; b = b->next)
+            if (a != b)
+                apply_acceleration(a, b);
+
+        for (size_t i = 0; i < num_halo; i++)
+            apply_acceleration(a, &halo[i]);
+
+        for (int i = 0; i < NUM_CELLS; i++) {
+            if (cell_mass[i] == 0.f)
+                continue;
+
+            const float dx       = cell_x[i] - a->x;
+            const float dy       = cell_y[i] - a->y;
+            const float distance = sqrtf(dx * dx + dy * dy);
+            if (distance > 0.f)
+                attract(a, dx, dy, distance, cell_mass[i]);
+        }
+    }
+}
+
+/* Main function of each worker process. The `bodies' list starts with the
+ * whole scene, and only the bodies of this domain are kept. */
+static void domain_worker(Transport* transport, float* bounds, uint64_t steps,
+                          size_t capacity) {
+    const int rank = transport->rank;
+
+    Body* prev = NULL;
+    Body* body = bodies;
+    while (body != NULL) {
+        Body* next = body->next;
+        if (body->x < bounds[rank] || body->x >= bounds[rank + 1])
+            retire_body(prev, body);
+        else
+            prev = body;
+        body = next;
+    }
+    free_retired_bodies();
+
+    Body* halo = malloc(capacity * sizeof(Body));
+    if (!halo)
+        die("Unable to allocate halo of domain %d.", rank);
+
+    static DomainCell cells[DOMAIN_CELLS_W * DOMAIN_CELLS_H];
+    uint64_t migrations = 0;
+    uint32_t rebalances = 0;
+    const double start  = get_seconds();
+
+    for (uint64_t step = 0; step < steps; step++) {
+        const size_t num_halo =
+          domain_exchange_halo(transport, bounds, halo, cells);
+        domain_apply_gravity(halo, num_halo, cells);
+
+        move_bodies();
+        apply_bounds();
+        sim_step++;
+
+        migrations += domain_migrate(transport, bounds);
+        if (sim_step % DOMAIN_REBALANCE == 0 &&
+            domain_rebalance(transport, bounds))
+            rebalances++;
+    }
+
+    const double elapsed = get_seconds() - start;
+    free(halo);
+
+    /* Gather the statistics in the first domain */
+    DomainExport* out = transport->outbox(transport);
+    memset(&out->total, 0, sizeof(out->total));
+    out->num_local  = 0;
+    out->migrations = migrations;
+    out->rebalances = rebalances;
+    for (Body* body = bodies; body != NULL; body = body->next) {
+        domain_cell_add(&out->total, body->x, body->y, body->mass);
+        out->num_local++;
+    }
+
+    transport->exchange(transport);
+    if (rank != 0)
+        return;
+
+    DomainCell total    = { 0 };
+    uint64_t num_bodies = 0;
+    migrations          = 0;
+    for (int other = 0; other < transport->num_domains; other++) {
+        const DomainExport* in = transport->inbox(transport, other);
+        num_bodies += in->num_local;
+        migrations += in->migrations;
+        total.mass += in->total.mass;
+        total.mass_x += in->total.mass_x;
+        total.mass_y += in->total.mass_y;
+    }
+
+    printf("Simulated %llu steps with %llu bodies in %d domains in %.3fs "
+           "(%.1f steps/s)\n",
+           (unsigned long long)steps, (unsigned long long)num_bodies,
+           transport->num_domains, elapsed, steps / elapsed);
+    for (int other = 0; other < transport->num_domains; other++) {
+        const DomainExport* in = transport->inbox(transport, other);
+        printf("Domain %d: %u bodies\n", other, in->num_local);
+    }
+    printf("Migrations: %llu, rebalances: %u\n",
+           (unsigned long long)migrations, rebalances);
+    if (total.mass > 0.0)
+        printf("Center of mass: %.4f, %.4f\n", total.mass_x / total.mass,
+               total.mass_y / total.mass);
+}
+
+/* Simulate the scene of `bench_solvers' with `num' bodies for `steps' steps,
+ * in `num_domains' processes */
+static void run_domains(int num_domains, size_t num, uint64_t steps) {
+    const float old_mass = current_mass;
+    current_mass         = 0.05f;
+    add_random_bodies(num, 1337);
+    current_mass = old_mass;
+
+    /* Initial slabs with the same number of bodies */
+    static uint32_t histogram[DOMAIN_BINS];
+    for (Body* body = bodies; body != NULL; body = body->next)
+        histogram[domain_bin(body->x)]++;
+
+    float bounds[DOMAIN_MAX + 1];
+    domain_split(histogram, num_domains, bounds);
+
+    Transport transport;
+    shm_transport_open(&transport, num_domains, num);
+
+    /* Don't duplicate buffered output in the workers */
+    fflush(NULL);
+
+    pid_t workers[DOMAIN_MAX];
+    for (int rank = 0; rank < num_domains; rank++) {
+        workers[rank] = fork();
+        if (workers[rank] < 0)
+            die("Unable to create worker process.");
+
+        if (workers[rank] == 0) {
+            transport.rank = rank;
+            domain_worker(&transport, bounds, steps, num);
+            fflush(stdout);
+            _exit(0);
+        }
+    }
+
+    free_bodies();
+    free_retired_bodies();
+
+    /* If a worker fails, the others would wait for it forever */
+    for (int i = 0; i < num_domains; i++) {
+        int status;
+        const pid_t pid = wait(&status);
+        if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            for (int rank = 0; rank < num_domains; rank++)
+                kill(workers[rank], SIGKILL);
+            die("Worker process failed.");
+        }
+    }
+
+    shm_transport_close(&transport);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void usage(const char* prog) {
+    die("Usage: %s [--solver direct|fmm|pm] "
+        "[--bounds open|wrap|reflect|retire] [--fmm-order N] "
+        "[--pm-resolution N] [--no-p3m] [--static-cache] [--no-far-field] "
+        "[--bench N] [--record FILE] [--replay FILE [--expect CHECKSUM]] "
+        "[--export FILE] [--ensemble FILE [--ensemble-out FILE] "
+        "[--ensemble-bodies N] [--threads N]] [--domains N [--bodies N]] "
+        "[--steps N]",
+        prog);
+}
+
+int main(int argc, char** argv) {
+    size_t bench_bodies       = 0;
+    const char* record_path   = NULL;
+    const char* replay_path   = NULL;
+    const char* replay_expect = NULL;
+    const char* export_path   = NULL;
+    const char* ensemble_path = NULL;
+    const char* ensemble_out  = NULL;
+    int ensemble_threads      = 0;
+    int num_domains           = 0;
+    size_t num_bodies         = 2000;
+    uint64_t num_steps        = 1000;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--solver") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "direct") == 0)
+                gravity_solver = GRAVITY_DIRECT;
+            else if (strcmp(argv[i], "fmm") == 0)
+                gravity_solver = GRAVITY_FMM;
+            else if (strcmp(argv[i], "pm") == 0)
+                gravity_solver = GRAVITY_PM;
+            else
+                usage(argv[0]);
+        } else if (strcmp(argv[i], "--bounds") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "open") == 0)
+                bounds_policy = BOUNDS_OPEN;
+            else if (strcmp(argv[i], "wrap") == 0)
+                bounds_policy = BOUNDS_WRAP;
+            else if (strcmp(argv[i], "reflect") == 0)
+                bounds_policy = BOUNDS_REFLECT;
+            else if (strcmp(argv[i], "retire") == 0)
+                bounds_policy = BOUNDS_RETIRE;
+            else
+                usage(argv[0]);
+        } else if (strcmp(argv[i], "--fmm-order") == 0 && i + 1 < argc) {
+            fmm_order = atoi(argv[++i]);
+            if (fmm_order < 1 || fmm_order > FMM_MAX_ORDER)
+                die("The FMM order must be between 1 and %d.", FMM_MAX_ORDER);
+        } else if (strcmp(argv[i], "--pm-resolution") == 0 && i + 1 < argc) {
+            pm_resolution = atoi(argv[++i]);
+            if (pm_resolution < PM_MIN_RESOLUTION ||
+                pm_resolution > PM_MAX_RESOLUTION ||
+                (pm_resolution & (pm_resolution - 1)) != 0)
+                die("The PM resolution must be a power of two between %d and "
+                    "%d.",
+                    PM_MIN_RESOLUTION, PM_MAX_RESOLUTION);
+        } else if (strcmp(argv[i], "--static-cache") == 0) {
+            static_cache = true;
+        } else if (strcmp(argv[i], "--no-far-field") == 0) {
+            far_field = false;
+        } else if (strcmp(argv[i], "--no-p3m") == 0) {
+            pm_p3m = false;
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench_bodies = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--expect") == 0 && i + 1 < argc) {
+            replay_expect = argv[++i];
+        } else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+            export_path = argv[++i];
+        } else if (strcmp(argv[i], "--ensemble") == 0 && i + 1 < argc) {
+            ensemble_path = argv[++i];
+        } else if (strcmp(argv[i], "--ensemble-out") == 0 && i + 1 < argc) {
+            ensemble_out = argv[++i];
+        } else if (strcmp(argv[i], "--ensemble-bodies") == 0 && i + 1 < argc) {
+            ensemble_bodies = atoi(argv[++i]);
+            if (ensemble_bodies < 2)
+                die("Ensemble scenes need at least 2 bodies.");
+        } else if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc) {
+            num_steps = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            ensemble_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--domains") == 0 && i + 1 < argc) {
+            num_domains = atoi(argv[++i]);
+            if (num_domains < 1 || num_domains > DOMAIN_MAX)
+                die("The number of domains must be between 1 and %d.",
+                    DOMAIN_MAX);
+        } else if (strcmp(argv[i], "--bodies") == 0 && i + 1 < argc) {
+            num_bodies = strtoull(argv[++i], NULL, 10);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    /* Headless modes */
+    if (bench_bodies > 0) {
+        bench_solvers(bench_bodies);
+        return 0;
+    }
+    if (replay_path != NULL) {
+        if (export_path != NULL)
+            export_open(export_path);
+
+        replay_journal(replay_path, replay_expect);
+        return 0;
+    }
+    if (ensemble_path != NULL) {
+        run_ensemble(ensemble_path, ensemble_out, num_steps,
+                     ensemble_threads);
+        return 0;
+    }
+    if (num_domains > 0) {
+        run_domains(num_domains, num_bodies, num_steps);
+        return 0;
+    }
+
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) != 0)
+        die("Unable to start SDL.");
+
+    /* Create SDL window */
+    SDL_Window* sdl_window =
+      SDL_CreateWindow("Orbit", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                       GRID_W, GRID_H, 0);
+    if (!sdl_window)
+        die("Error creating SDL window.");
+
+    /* Create SDL renderer */
+    SDL_Renderer* sdl_renderer =
+      SDL_CreateRenderer(sdl_window, -1,
+                         SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    if (!sdl_renderer) {
+        SDL_DestroyWindow(sdl_window);
+        die("Error creating SDL renderer.");
+    }
+
+    if (record_path != NULL)
+        journal_open(record_path);
+    if (export_path != NULL)
+        export_open(export_path);
+
+    FramePacer pacer;
+    frame_init(&pacer);
+
+    /* Main loop */
+    bool running = true;
+    while (running) {
+        frame_start(&pacer);
+
+        /* Parse SDL events, and apply the actions in this step */
+        SDL_Event sdl_event;
+        while (running && SDL_PollEvent(&sdl_event)) {
+            if (handle_camera_event(&sdl_event))
+                continue;
+
+            Action action;
+            if (!event_to_action(&sdl_event, &action))
+                continue;
+
+            journal_record(&action);
+            running = apply_action(&action);
+        }
+
+        if (!running)
+            break;
+
+        /* Clear window */
+        set_render_color(sdl_renderer, 0x000000);
+        SDL_RenderClear(sdl_renderer);
+
+        /* Calculate the accelerations and move the bodies, once for each step
+         * of elapsed time. Like when replaying, one frame is exported per
+         * step, so the video plays at FPS regardless of the frame rate. */
+        while (pacer.accumulator >= FRAME_SECONDS) {
+            frame_step(&pacer);
+            export_frame(1.f);
+        }
+
+        /* Render the valid bodies */
+        frame_render(&pacer, sdl_renderer);
+
+        /* Send to renderer and wait for the next step */
+        SDL_RenderPresent(sdl_renderer);
+        frame_wait(&pacer);
+    }
+
+    journal_close();
+    export_close();
+
     /* Free our linked list of bodies */
     free_bodies();
+    free_retired_bodies();
 
     SDL_DestroyRenderer(sdl_renderer);
     SDL_DestroyWindow(sdl_window);